@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dict.h"
+#include "log.h"
+#include "metrics.h"
+
+// Words scoring less than EASY_SCORE but at least MEDIUM_SCORE are medium
+#define EASY_SCORE 15
+#define MEDIUM_SCORE 13
+
+static const char *band_names[] = {"easy", "medium", "hard", "any"};
+
+/* The state of the generator the worker running on the current thread picks
+ * words with. Each worker has its own, so that the words it picks only
+ * depend on its seed and on its own games (see record.h).
+ */
+static __thread unsigned short word_rng[3];
+
+
+/* The version of the dictionary new games pick their words from. The lock
+ * makes taking a reference to it atomic with respect to replacing it.
+ */
+static struct dictionary *current = NULL;
+static pthread_mutex_t current_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Return the length of the word that starts at word, which ends at the
+ * next newline or at end, without a carriage return from a DOS file.
+ */
+static int word_length(const char *word, const char *end) {
+    const char *nl = memchr(word, '\n', end - word);
+    int len = nl ? nl - word : end - word;
+    if (len > 0 && word[len - 1] == '\r') {
+        len--;
+    }
+    return len;
+}
+
+
+/* Return the band of the len bytes of word, or -1 if word has no lower case
+ * letter to guess.
+ */
+static int word_band(const char *word, int len) {
+    unsigned letters = 0;
+    for (int i = 0; i < len; i++) {
+        if (word[i] >= 'a' && word[i] <= 'z') {
+            letters |= 1u << (word[i] - 'a');
+        }
+    }
+    if (letters == 0) {
+        return -1;
+    }
+    int score = len + __builtin_popcount(letters);
+    if (score >= EASY_SCORE) {
+        return BAND_EASY;
+    }
+    return score >= MEDIUM_SCORE ? BAND_MEDIUM : BAND_HARD;
+}
+
+
+/* Map the file filename, which has one word per line, and index it.
+ * Return the new dictionary with one reference held by the caller, or NULL
+ * if it could not be loaded. Words longer than DICT_MAX_LEN are skipped, and
+ * so are words without a lower case letter, which would be won by any guess.
+ * Reports how long loading took, how much memory the new version uses and
+ * how many words each band has.
+ */
+struct dictionary *load_dictionary(const char *filename) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror("Opening dictionary");
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+    if (st.st_size == 0) {
+        fprintf(stderr, "The dictionary %s is empty\n", filename);
+        close(fd);
+        return NULL;
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    char *words = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (words == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    madvise(words, st.st_size, MADV_WILLNEED);
+
+    // Count the lines so that offsets can be allocated at once
+    size_t length = st.st_size;
+    int lines = 1;
+    for (const char *p = words; (p = memchr(p, '\n', words + length - p)) != NULL; p++) {
+        lines++;
+    }
+
+    struct dictionary *dict = malloc(sizeof(struct dictionary));
+    unsigned int *found = malloc(sizeof(unsigned int) * lines);
+    unsigned char *bands = malloc(lines);
+    if (!dict || !found || !bands) {
+        perror("malloc");
+        exit(1);
+    }
+
+    // Record where each word that fits starts, and its band
+    int size = 0, skipped = 0, unguessable = 0;
+    int count[NUM_BANDS] = {0};
+    size_t pos = 0;
+    while (pos < length) {
+        const char *nl = memchr(words + pos, '\n', length - pos);
+        size_t next = nl ? (size_t)(nl - words) + 1 : length;
+        int len = (nl ? (size_t)(nl - words) : length) - pos;
+        if (len > 0 && words[pos + len - 1] == '\r') {
+            len--;
+        }
+        int band = len > 0 ? word_band(words + pos, len) : -1;
+        if (len > DICT_MAX_LEN) {
+            skipped++;
+        } else if (len > 0 && band == -1) {
+            unguessable++;
+        } else if (len > 0) {
+            bands[size] = band;
+            count[band]++;
+            found[size++] = pos;
+        }
+        pos = next;
+    }
+
+    if (size == 0) {
+        fprintf(stderr, "The dictionary %s has no words\n", filename);
+        munmap(words, length);
+        free(found);
+        free(bands);
+        free(dict);
+        return NULL;
+    }
+
+    // Order the words by band, keeping the order of the file within each
+    unsigned int *offsets = malloc(sizeof(unsigned int) * size);
+    if (!offsets) {
+        perror("malloc");
+        exit(1);
+    }
+    int next[NUM_BANDS];
+    dict->band_start[0] = 0;
+    for (int b = 0; b < NUM_BANDS; b++) {
+        next[b] = dict->band_start[b];
+        dict->band_start[b + 1] = dict->band_start[b] + count[b];
+    }
+    for (int i = 0; i < size; i++) {
+        offsets[next[bands[i]]++] = found[i];
+    }
+    free(found);
+    free(bands);
+
+    dict->words = words;
+    dict->length = length;
+    dict->offsets = offsets;
+    dict->size = size;
+    dict->refs = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    log_info("Loaded %d words from %s in %.2f ms (%zu KB mapped, %zu KB index, "
+        "%zu KB while building)", size, filename, ms, length / 1024,
+        sizeof(unsigned int) * size / 1024,
+        (sizeof(unsigned int) * (lines + size) + lines) / 1024);
+    log_info("%d easy, %d medium and %d hard words; %d longer than %d letters and "
+        "%d without a letter skipped", count[BAND_EASY], count[BAND_MEDIUM],
+        count[BAND_HARD], skipped, DICT_MAX_LEN, unguessable);
+    return dict;
+}
+
+
+/* Make dict the version that new games pick their words from, taking over
+ * the caller's reference. The previous version is unmapped once the last
+ * game using it has released it.
+ */
+void publish_dictionary(struct dictionary *dict) {
+    pthread_mutex_lock(&current_lock);
+    struct dictionary *old = current;
+    current = dict;
+    pthread_mutex_unlock(&current_lock);
+
+    if (old != NULL) {
+        release_dictionary(old);
+    }
+}
+
+
+/* Return the current version of the dictionary with a reference held by the
+ * caller, who must release it with release_dictionary.
+ */
+struct dictionary *acquire_dictionary(void) {
+    pthread_mutex_lock(&current_lock);
+    struct dictionary *dict = current;
+    __atomic_add_fetch(&dict->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&current_lock);
+    return dict;
+}
+
+
+/* Drop a reference to dict, unmapping it if that was the last one */
+void release_dictionary(struct dictionary *dict) {
+    if (__atomic_sub_fetch(&dict->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        log_info("Unloading dictionary of %d words", dict->size);
+        munmap((void *) dict->words, dict->length);
+        free(dict->offsets);
+        free(dict);
+    }
+}
+
+
+/* Make the current thread pick its words with seed from now on */
+void seed_words(unsigned seed) {
+    word_rng[0] = 0x330e;
+    word_rng[1] = seed & 0xffff;
+    word_rng[2] = seed >> 16;
+}
+
+
+/* Return the index of a word picked uniformly at random from the words of
+ * band in dict, or from every word if band has none.
+ */
+unsigned pick_word(const struct dictionary *dict, enum band band) {
+    uint64_t start = now_ns();
+    int first = 0, count = dict->size;
+    if (band != BAND_ANY && dict->band_start[band + 1] > dict->band_start[band]) {
+        first = dict->band_start[band];
+        count = dict->band_start[band + 1] - first;
+    }
+    unsigned index = first + nrand48(word_rng) % count;
+    metrics_latency(LAT_DICT_PICK, start);
+    return index;
+}
+
+
+/* Copy word number index of dict into buf, which has room for size bytes,
+ * truncating it if necessary.
+ * Return the length of the copied word.
+ */
+int copy_word(const struct dictionary *dict, unsigned index, char *buf, int size) {
+    unsigned int start = dict->offsets[index];
+    const char *word = dict->words + start;
+    int len = word_length(word, dict->words + dict->length);
+
+    if (len > size - 1) {
+        len = size - 1;
+    }
+    memcpy(buf, word, len);
+    buf[len] = '\0';
+    return len;
+}
+
+
+/* Return the name of band, as accepted by parse_band */
+const char *band_name(enum band band) {
+    return band_names[band];
+}
+
+
+/* Return the band called name, or -1 if there is none */
+int parse_band(const char *name) {
+    for (int b = 0; b <= BAND_ANY; b++) {
+        if (strcmp(name, band_names[b]) == 0) {
+            return b;
+        }
+    }
+    return -1;
+}
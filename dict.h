@@ -0,0 +1,50 @@
+#ifndef _DICT_H_
+#define _DICT_H_
+
+#include <stddef.h>
+
+#define DICT_MAX_LEN 19       // Longer words are left out of the index
+
+/* How hard the words of a game are. A word's band comes from its length
+ * plus its number of distinct letters: short words with few letters leave
+ * the fewest chances to hit one. BAND_ANY picks from every word.
+ */
+enum band {
+    BAND_EASY,
+    BAND_MEDIUM,
+    BAND_HARD,
+    BAND_ANY,
+    NUM_BANDS = BAND_ANY
+};
+
+/* A version of the dictionary. The file is mapped into memory read-only and
+ * indexed in place: offsets[i] is where word i starts in words, and the word
+ * ends at the next newline. The index is ordered by band, so that the words
+ * of band b are offsets[band_start[b]] up to offsets[band_start[b + 1]], and
+ * a word can be picked from any band in constant time. It is never modified
+ * after loading, so every room and worker thread can share it.
+ *
+ * The dictionary can be reloaded while the server runs. Each room holds a
+ * reference to the version its current word came from, so an old version is
+ * only unmapped once every game using it has finished.
+ */
+struct dictionary {
+    const char *words;        // The mapped file
+    size_t length;            // Number of bytes mapped
+    unsigned int *offsets;
+    int size;                 // Number of words
+    int band_start[NUM_BANDS + 1];
+    int refs;                 // Number of references, including being current
+};
+
+struct dictionary *load_dictionary(const char *filename);
+void publish_dictionary(struct dictionary *dict);
+struct dictionary *acquire_dictionary(void);
+void release_dictionary(struct dictionary *dict);
+void seed_words(unsigned seed);
+unsigned pick_word(const struct dictionary *dict, enum band band);
+int copy_word(const struct dictionary *dict, unsigned index, char *buf, int size);
+const char *band_name(enum band band);
+int parse_band(const char *name);
+
+#endif
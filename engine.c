@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "engine.h"
+
+
+// The band of the words of new rooms
+enum band default_band = BAND_ANY;
+
+
+/* Append an event of the given type about player to out, and return it for
+ * the caller to fill in the fields that type uses.
+ */
+static struct game_event *emit(struct game_events *out, enum event_type type,
+        struct client *player){
+    if (out->len == out->cap){
+        int cap = out->cap > 0 ? out->cap * 2 : 16;
+        struct game_event *events = realloc(out->events, cap * sizeof(struct game_event));
+        if (!events){
+            perror("realloc");
+            exit(1);
+        }
+        out->events = events;
+        out->cap = cap;
+    }
+    struct game_event *e = &out->events[out->len++];
+    e->type = type;
+    e->player = player;
+    return e;
+}
+
+
+/* Append the len bytes of text for player, or for the whole room if player
+ * is NULL. text is a string literal, or in the text of out.
+ */
+static void emit_text(struct game_events *out, struct client *player, const char *text, int len){
+    struct game_event *e = emit(out, EV_TEXT, player);
+    e->text = text;
+    e->len = len;
+}
+
+
+/* Append text formatted from fmt for player, or for the whole room if
+ * player is NULL. The text is kept in out, and cut short if it runs past
+ * EVENT_TEXT bytes since out was last cleared.
+ */
+static void emit_format(struct game_events *out, struct client *player, const char *fmt, ...){
+    char *text = out->text + out->text_len;
+    int room = EVENT_TEXT - out->text_len;
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(text, room, fmt, args);
+    va_end(args);
+    if (len > room - 1){
+        len = room - 1;
+    }
+    out->text_len += len + 1;
+    emit_text(out, player, text, len);
+}
+
+
+/* Empty out, once its events have been delivered */
+void clear_events(struct game_events *out){
+    out->len = 0;
+    out->text_len = 0;
+}
+
+
+/* Move the has_next_turn pointer to the next active client */
+static void advance_turn(struct game_state *game, struct game_events *out){
+    // If first person was added/reached end of the list
+    if (game->has_next_turn == NULL || game->has_next_turn->next == NULL){
+        game->has_next_turn = game->head;
+    } else {
+        game->has_next_turn = game->has_next_turn->next;
+    }
+    emit(out, EV_CLOCK, NULL);
+}
+
+
+/* Process the guess of player.
+*  Prerequisite: letter is a valid lower case letter to guess
+*/
+static void guess_char(struct game_state *game, struct client *player, char letter,
+        struct game_events *out){
+    uint32_t bit = LETTER_BIT(letter);
+    int hit = (game->in_word & bit) != 0;
+
+    player->guesses++;
+    game->guessed |= bit;
+    game->remaining &= ~bit;
+    if (!hit){
+        game->guesses_left--;
+    }
+
+    struct game_event *e = emit(out, EV_GUESS, player);
+    e->letter = letter;
+    e->hit = hit;
+    e->guesses_left = game->guesses_left;
+    e->positions = game->positions[letter - 'a'];
+
+    if (!hit){
+        advance_turn(game, out);
+    } else {
+        emit(out, EV_CLOCK, NULL);
+    }
+}
+
+
+/* Answer line, sent by player, if it is the command
+ *    level [BAND]  the band words are picked from; with BAND, change it
+ *                  from the next game on and tell the room
+ * which leaves the current game as it is. Commands about scores are
+ * answered before the line gets here, see answer_scores in game.c.
+ * Return 1 if the line was a command, 0 otherwise.
+ */
+static int answer_command(struct game_state *game, struct client *player, const char *line,
+        struct game_events *out){
+    static const char levels[] = "The level is one of easy, medium, hard, any\r\n";
+    if (strcmp(line, "level") == 0){
+        emit_format(out, player, "Words are %s (one of easy, medium, hard, any)\r\n",
+            band_name(game->band));
+    } else if (strncmp(line, "level ", 6) == 0){
+        int band = parse_band(line + 6);
+        if (band == -1){
+            emit_text(out, player, levels, sizeof(levels) - 1);
+        } else {
+            game->band = band;
+            emit_format(out, NULL, "%s chose %s words from the next game on\r\n",
+                player->name, band_name(band));
+        }
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+
+/* End the game: winner won, if not NULL, and everyone else lost */
+static void end_game(struct game_state *game, struct client *winner, struct game_events *out){
+    struct game_event *e = emit(out, EV_GAME_OVER, winner);
+    memcpy(e->word, game->word, game->word_len + 1);
+    for (struct client *curr = game->head; curr != NULL; curr = curr->next){
+        e = emit(out, EV_RESULT, curr);
+        e->won = curr == winner;
+        e->lost = curr != winner;
+        e->guesses = curr->guesses;
+        curr->guesses = 0;
+    }
+}
+
+
+/* Checks if game is finished, and ends it if so.
+- Returns 1 if game is not over
+- Returns 0 if game is over
+*/
+static int check_game_over(struct game_state *game, struct client *curr_player,
+        struct game_events *out){
+    /* Game over conditions (guesses_left == 0 or word successfully guessed) are mutually exclusive
+       since guesses_left does not decrease when a letter is guessed successfully
+    */
+
+    // Check if there are no more guesses
+    if (game->guesses_left == 0){
+        end_game(game, NULL, out);
+        return 0;
+    }
+
+    // Check if word has been guessed
+    if (game->remaining != 0){
+        return 1;
+    }
+    end_game(game, curr_player, out);
+    return 0;
+}
+
+
+/* Handle line, a complete line sent by player in game.
+    - If it is a valid guess (single, lowercase, unguessed letter) that ends
+      the game, start a new one and return 2.
+    - If it is any other valid guess, return 1.
+    - If it is a command, an invalid guess or a guess out of turn, answer
+      player and return 0.
+*/
+int engine_line(struct game_state *game, struct client *player, const char *line,
+        struct game_events *out){
+    const char *error = NULL;
+    if (answer_command(game, player, line, out)){
+        // Commands can be sent at any time
+        return 0;
+    } else if (player != game->has_next_turn){
+        error = "It's not yet your turn!\r\n";
+    } else if (line[0] == '\0'){
+        error = "Enter something non-empty...\r\n";
+    } else if (line[1] != '\0'){
+        error = "That guess is too long. Input just one character\r\n";
+    } else if ('a' > line[0] || line[0] > 'z'){
+        error = "Enter a lowercase letter...\r\n";
+    } else if (game->guessed & LETTER_BIT(line[0])){
+        error = "That letter has already been guessed...\r\n";
+    }
+    if (error != NULL){
+        emit_text(out, player, error, strlen(error));
+        return 0;
+    }
+
+    guess_char(game, player, line[0], out);
+    int over = check_game_over(game, player, out) == 0;
+    if (over){
+        init_game(game);
+        emit(out, EV_NEW_GAME, NULL);
+    }
+    emit(out, EV_STATUS, NULL);
+    emit(out, EV_TURN, NULL);
+    return over ? 2 : 1;
+}
+
+
+/* Welcome player, who has just been added to game->head by join_room */
+void engine_join(struct game_state *game, struct client *player, struct game_events *out){
+    // if this is the first person to be added
+    if (game->has_next_turn == NULL){
+        advance_turn(game, out);
+    }
+    emit(out, EV_JOIN, player);
+    emit(out, EV_STATUS, player);
+    emit(out, EV_TURN, NULL);
+}
+
+
+/* Move the turn on if it was player's, who has just been removed from
+ * game->head with unlink_client, and keep their guesses.
+Prerequisites: player was an active player in the game
+*/
+void engine_leave(struct game_state *game, struct client *player, struct game_events *out){
+    // If it was currently player's turn. player->next still points to
+    // the player who comes after them.
+    if (game->has_next_turn == player){
+        advance_turn(game, out);
+    }
+
+    // Keep the guesses of a game that player did not finish
+    if (player->guesses > 0){
+        struct game_event *e = emit(out, EV_RESULT, player);
+        e->won = 0;
+        e->lost = 0;
+        e->guesses = player->guesses;
+    }
+    emit(out, EV_LEAVE, player);
+    emit(out, EV_TURN, NULL);
+}
+
+
+/* Move the turn on, since the player who has it took too long to guess */
+void engine_timeout(struct game_state *game, struct game_events *out){
+    emit(out, EV_TIMEOUT, game->has_next_turn);
+    advance_turn(game, out);
+    emit(out, EV_TURN, NULL);
+}
+
+
+/* Return 1 if word number index of game->dict is one of the last
+ * RECENT_WORDS words of game, 0 otherwise.
+ */
+static int is_recent(struct game_state *game, unsigned index) {
+    unsigned count = game->num_recent < RECENT_WORDS ? game->num_recent : RECENT_WORDS;
+    for (unsigned i = 0; i < count; i++) {
+        if (game->recent[i] == index) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* Pick the word of the next game from the band of game in game->dict,
+ * avoiding the last RECENT_WORDS words unless the band is too small.
+ */
+static void pick_game_word(struct game_state *game) {
+    unsigned index = pick_word(game->dict, game->band);
+    for (int tries = 1; tries < RECENT_TRIES && is_recent(game, index); tries++) {
+        index = pick_word(game->dict, game->band);
+    }
+    game->recent[game->num_recent++ % RECENT_WORDS] = index;
+    game->word_len = copy_word(game->dict, index, game->word, MAX_WORD);
+}
+
+
+/* Record which letters appear in game->word, and where */
+void index_word(struct game_state *game) {
+    game->in_word = 0;
+    memset(game->positions, 0, sizeof(game->positions));
+    for(int i = 0; i < game->word_len; i++) {
+        char c = game->word[i];
+        if (c >= 'a' && c <= 'z') {
+            game->in_word |= LETTER_BIT(c);
+            game->positions[c - 'a'] |= (uint32_t) 1 << i;
+        }
+    }
+}
+
+
+/* Initialize the gameboard:
+ *    - select a random word to guess from the band of game in the current
+ *      dictionary, and hold on to that version of the dictionary until the
+ *      next game
+ *    - record which letters appear in the word
+ *    - initialize the other fields
+ * We can't initialize head and has_next_turn because these will have
+ * different values when we use init_game to create a new game after one
+ * has already been played. The status message is rendered by whoever
+ * delivers EV_NEW_GAME.
+ */
+void init_game(struct game_state *game) {
+    struct dictionary *dict = acquire_dictionary();
+    if (game->dict != dict) {
+        // The recent words are indexes in the version they came from
+        game->num_recent = 0;
+    }
+    if (game->dict != NULL) {
+        release_dictionary(game->dict);
+    }
+    game->dict = dict;
+    pick_game_word(game);
+
+    index_word(game);
+    game->remaining = game->in_word;
+    game->guessed = 0;
+    game->guesses_left = MAX_GUESSES;
+}
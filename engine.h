@@ -0,0 +1,69 @@
+#ifndef _ENGINE_H_
+#define _ENGINE_H_
+
+#include <stdint.h>
+
+#include "game.h"
+
+/* The rules of the game, as a state machine that does no I/O. It is told
+ * what players do (join, send a line, leave, run out of time), updates the
+ * room, and appends what happened to a struct game_events owned by the
+ * caller. The caller decides how to render the events and when to send
+ * them, see deliver_events in game.c. Nothing in here writes to a client
+ * or disconnects one.
+ */
+enum event_type {
+    EV_TEXT,          // len bytes of text for player, or the room if NULL
+    EV_JOIN,          // player entered the game
+    EV_LEAVE,         // player left the game
+    EV_TIMEOUT,       // player ran out of time
+    EV_GUESS,         // player guessed letter: hit, positions, guesses_left
+    EV_GAME_OVER,     // The game of word ended, won by player unless NULL
+    EV_NEW_GAME,      // A new game started
+    EV_STATUS,        // player, or the room if NULL, needs the game status
+    EV_TURN,          // The room needs to be told who has the turn
+    EV_CLOCK,         // The player who has the turn starts a new turn
+    EV_RESULT         // player finished a game: won, lost, guesses
+};
+
+struct game_event {
+    enum event_type type;
+    struct client *player;
+    const char *text;         // EV_TEXT, valid until the events are cleared
+    int len;
+    char letter;
+    unsigned char hit;
+    unsigned char guesses_left;
+    unsigned char won;
+    unsigned char lost;
+    int guesses;
+    uint32_t positions;       // Bit i is set if letter is at position i
+    char word[MAX_WORD];
+};
+
+#define EVENT_TEXT 512        // Bytes of text the events can hold between clears
+
+/* A buffer of events, owned by the caller and reused from one call to the
+ * next, and the text they refer to. It grows as needed and is never
+ * shrunk; clear_events empties it.
+ */
+struct game_events {
+    struct game_event *events;
+    int len;
+    int cap;
+    char text[EVENT_TEXT];
+    int text_len;
+};
+
+extern enum band default_band;
+
+void clear_events(struct game_events *out);
+void index_word(struct game_state *game);
+void init_game(struct game_state *game);
+void engine_join(struct game_state *game, struct client *player, struct game_events *out);
+void engine_leave(struct game_state *game, struct client *player, struct game_events *out);
+int engine_line(struct game_state *game, struct client *player, const char *line,
+    struct game_events *out);
+void engine_timeout(struct game_state *game, struct game_events *out);
+
+#endif
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <getopt.h>
+
+#include "game.h"
+#include "engine.h"
+#include "metrics.h"
+
+/* Drives the rules of engine.c without any sockets. By default, it plays
+ * scripted moves in a room and checks the events they emit: the turn moving
+ * on, a letter guessed twice, a win, a loss and a player leaving on their
+ * turn. It exits with status 1 at the first event that is not as expected.
+ * With --bench MOVES, it plays MOVES guesses as fast as it can instead and
+ * reports moves/s.
+ */
+
+#define BENCH_PLAYERS 4
+
+// Exit with status 1 unless cond holds
+#define CHECK(cond) \
+    do { if (!(cond)) fail(__LINE__, #cond); } while (0)
+
+struct game_events out;
+int checks = 0;
+
+
+/* Report the check at line that failed, and exit */
+void fail(int line, const char *cond){
+    fprintf(stderr, "enginecheck.c:%d: check failed: %s\n", line, cond);
+    exit(1);
+}
+
+
+/* Check that out holds count events, of the types that follow, in order */
+void expect(int count, ...){
+    va_list types;
+    va_start(types, count);
+    CHECK(out.len == count);
+    for (int i = 0; i < count; i++){
+        CHECK(out.events[i].type == va_arg(types, enum event_type));
+    }
+    va_end(types);
+    checks++;
+}
+
+
+/* Make word the word of the current game of game */
+void set_word(struct game_state *game, const char *word){
+    strcpy(game->word, word);
+    game->word_len = strlen(word);
+    index_word(game);
+    game->remaining = game->in_word;
+    game->guessed = 0;
+    game->guesses_left = MAX_GUESSES;
+}
+
+
+/* Add player, called name, to the head of game the way join_room does */
+void join(struct game_state *game, struct client *player, const char *name){
+    memset(player, 0, sizeof(struct client));
+    player->fd = -1;
+    player->active = 1;
+    player->name = name;
+    player->game = game;
+    player->next = game->head;
+    if (game->head != NULL){
+        game->head->prev = player;
+    }
+    game->head = player;
+    game->num_players++;
+    clear_events(&out);
+    engine_join(game, player, &out);
+}
+
+
+/* Remove player from game the way leave_handler does */
+void leave(struct game_state *game, struct client *player){
+    if (player->prev != NULL){
+        player->prev->next = player->next;
+    } else {
+        game->head = player->next;
+    }
+    if (player->next != NULL){
+        player->next->prev = player->prev;
+    }
+    player->prev = NULL;
+    clear_events(&out);
+    engine_leave(game, player, &out);
+    game->num_players--;
+}
+
+
+/* Have player send line, and return what engine_line returned */
+int play(struct game_state *game, struct client *player, const char *line){
+    clear_events(&out);
+    return engine_line(game, player, line, &out);
+}
+
+
+/* Play the scripted moves, checking every event they emit */
+void check_rules(void){
+    struct game_state game = {0};
+    struct client ann, bob, cat;
+    game.band = default_band;
+    init_game(&game);
+
+    // The first player to join gets the turn. Players join at the head of
+    // the list, so the order is bob, ann.
+    join(&game, &ann, "ann");
+    expect(4, EV_CLOCK, EV_JOIN, EV_STATUS, EV_TURN);
+    CHECK(out.events[1].player == &ann && out.events[2].player == &ann);
+    CHECK(game.has_next_turn == &ann);
+    join(&game, &bob, "bob");
+    expect(3, EV_JOIN, EV_STATUS, EV_TURN);
+    CHECK(game.has_next_turn == &ann);
+    set_word(&game, "abc");
+
+    // A miss costs a guess and moves the turn on, back to the head
+    CHECK(play(&game, &ann, "z") == 1);
+    expect(4, EV_GUESS, EV_CLOCK, EV_STATUS, EV_TURN);
+    CHECK(out.events[0].player == &ann && out.events[0].letter == 'z');
+    CHECK(out.events[0].hit == 0 && out.events[0].positions == 0);
+    CHECK(out.events[0].guesses_left == MAX_GUESSES - 1);
+    CHECK(game.has_next_turn == &bob);
+
+    // Only the player who has the turn can guess
+    CHECK(play(&game, &ann, "a") == 0);
+    expect(1, EV_TEXT);
+    CHECK(out.events[0].player == &ann);
+    CHECK(strcmp(out.events[0].text, "It's not yet your turn!\r\n") == 0);
+
+    // A hit keeps the turn and tells where the letter is
+    CHECK(play(&game, &bob, "b") == 1);
+    expect(4, EV_GUESS, EV_CLOCK, EV_STATUS, EV_TURN);
+    CHECK(out.events[0].hit == 1 && out.events[0].positions == 0x2);
+    CHECK(out.events[0].guesses_left == MAX_GUESSES - 1);
+    CHECK(game.has_next_turn == &bob);
+
+    // A letter guessed twice is refused and costs nothing
+    CHECK(play(&game, &bob, "b") == 0);
+    expect(1, EV_TEXT);
+    CHECK(out.events[0].player == &bob);
+    CHECK(strcmp(out.events[0].text, "That letter has already been guessed...\r\n") == 0);
+    CHECK(game.guesses_left == MAX_GUESSES - 1 && bob.guesses == 1);
+    CHECK(game.has_next_turn == &bob);
+
+    // Guessing the last letter wins; every player gets a result and a new
+    // game starts
+    CHECK(play(&game, &bob, "a") == 1);
+    CHECK(play(&game, &bob, "c") == 2);
+    expect(8, EV_GUESS, EV_CLOCK, EV_GAME_OVER, EV_RESULT, EV_RESULT,
+        EV_NEW_GAME, EV_STATUS, EV_TURN);
+    CHECK(out.events[2].player == &bob && strcmp(out.events[2].word, "abc") == 0);
+    CHECK(out.events[3].player == &bob && out.events[3].won && !out.events[3].lost);
+    CHECK(out.events[3].guesses == 3);
+    CHECK(out.events[4].player == &ann && !out.events[4].won && out.events[4].lost);
+    CHECK(out.events[4].guesses == 1);
+    CHECK(bob.guesses == 0 && ann.guesses == 0);
+    CHECK(game.guessed == 0 && game.guesses_left == MAX_GUESSES);
+    CHECK(game.has_next_turn == &bob);
+
+    // Missing with the last guess loses the game for everyone
+    set_word(&game, "abc");
+    game.guesses_left = 1;
+    CHECK(play(&game, &bob, "q") == 2);
+    expect(8, EV_GUESS, EV_CLOCK, EV_GAME_OVER, EV_RESULT, EV_RESULT,
+        EV_NEW_GAME, EV_STATUS, EV_TURN);
+    CHECK(out.events[0].hit == 0 && out.events[0].guesses_left == 0);
+    CHECK(out.events[2].player == NULL && strcmp(out.events[2].word, "abc") == 0);
+    CHECK(!out.events[3].won && out.events[3].lost);
+    CHECK(!out.events[4].won && out.events[4].lost);
+    CHECK(game.guesses_left == MAX_GUESSES);
+    CHECK(game.has_next_turn == &ann);
+
+    // A player who leaves on their turn hands it to the next player and
+    // keeps the guesses of the unfinished game. The order is cat, bob, ann.
+    join(&game, &cat, "cat");
+    expect(3, EV_JOIN, EV_STATUS, EV_TURN);
+    set_word(&game, "abc");
+    game.has_next_turn = &bob;
+    CHECK(play(&game, &bob, "a") == 1);
+    leave(&game, &bob);
+    expect(4, EV_CLOCK, EV_RESULT, EV_LEAVE, EV_TURN);
+    CHECK(out.events[1].player == &bob && !out.events[1].won && !out.events[1].lost);
+    CHECK(out.events[1].guesses == 1);
+    CHECK(out.events[2].player == &bob);
+    CHECK(game.has_next_turn == &ann);
+    CHECK(game.head == &cat && cat.next == &ann);
+
+    // A player who takes too long loses the turn
+    clear_events(&out);
+    engine_timeout(&game, &out);
+    expect(3, EV_TIMEOUT, EV_CLOCK, EV_TURN);
+    CHECK(out.events[0].player == &ann);
+    CHECK(game.has_next_turn == &cat);
+
+    // Levels are answered by the engine, in text it keeps until cleared
+    CHECK(play(&game, &ann, "level hard") == 0);
+    expect(1, EV_TEXT);
+    CHECK(out.events[0].player == NULL && game.band == BAND_HARD);
+    CHECK(strcmp(out.events[0].text, "ann chose hard words from the next game on\r\n") == 0);
+    CHECK(play(&game, &ann, "level") == 0);
+    expect(1, EV_TEXT);
+    CHECK(strncmp(out.events[0].text, "Words are hard ", 15) == 0);
+    printf("%d checks passed\n", checks);
+}
+
+
+/* Play moves guesses among BENCH_PLAYERS players, each guessing the first
+ * letter nobody has, and report how fast the engine went through them.
+ */
+void bench(long moves){
+    struct game_state game = {0};
+    struct client players[BENCH_PLAYERS];
+    game.band = default_band;
+    init_game(&game);
+    for (int i = 0; i < BENCH_PLAYERS; i++){
+        join(&game, &players[i], "bot");
+    }
+
+    long events = 0, games = 0;
+    char line[2] = "a";
+    uint64_t start = now_ns();
+    for (long i = 0; i < moves; i++){
+        line[0] = 'a' + __builtin_ctz(~game.guessed);
+        clear_events(&out);
+        games += engine_line(&game, game.has_next_turn, line, &out) == 2;
+        events += out.len;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    printf("moves          %ld in %.3f s (%.0f/s)\n", moves, seconds, moves / seconds);
+    printf("%-14s %ld (%.2f per move)\n", "events", events, (double) events / moves);
+    printf("%-14s %ld (%.2f moves per game)\n", "games", games,
+        games > 0 ? (double) moves / games : 0);
+}
+
+
+int main(int argc, char **argv){
+    long moves = 0;
+    struct option long_options[] = {
+        {"bench", required_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:", long_options, NULL)) != -1){
+        switch (opt){
+        case 'b':
+            moves = strtol(optarg, NULL, 10);
+            if (moves < 1){
+                moves = -1;
+            }
+            break;
+        default:
+            moves = -1;
+        }
+    }
+    if (optind != argc - 1 || moves < 0){
+        fprintf(stderr, "Usage: %s [--bench MOVES] dictionary.txt\n", argv[0]);
+        exit(1);
+    }
+
+    struct dictionary *dict = load_dictionary(argv[optind]);
+    if (dict == NULL){
+        exit(1);
+    }
+    publish_dictionary(dict);
+    // Picking words is timed, as it is on a worker
+    metrics = calloc(1, sizeof(struct metrics));
+    if (!metrics){
+        perror("calloc");
+        exit(1);
+    }
+    seed_words(1);
+
+    if (moves > 0){
+        bench(moves);
+    } else {
+        check_rules();
+    }
+    return 0;
+}
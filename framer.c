@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "framer.h"
+
+
+/* Input buffers that are not in use by the worker running on the current
+ * thread. Each free buffer holds a pointer to the next one.
+ */
+static __thread char *free_bufs = NULL;
+static __thread int num_free_bufs = 0;
+
+
+/* Give f a buffer from the pool if it does not have one */
+static void take_buf(struct framer *f){
+    if (f->buf != NULL){
+        return;
+    }
+    if (free_bufs != NULL){
+        f->buf = free_bufs;
+        free_bufs = *(char **) free_bufs;
+        num_free_bufs--;
+    } else {
+        f->buf = malloc(MAX_BUF + 1);
+        if (!f->buf){
+            perror("malloc");
+            exit(1);
+        }
+    }
+}
+
+
+/* Return the buffer of f to the pool, keeping at most MAX_POOLED_BUFS */
+static void give_back_buf(struct framer *f){
+    if (f->buf == NULL){
+        return;
+    }
+    if (num_free_bufs < MAX_POOLED_BUFS){
+        *(char **) f->buf = free_bufs;
+        free_bufs = f->buf;
+        num_free_bufs++;
+    } else {
+        free(f->buf);
+    }
+    // A line that was handed out in pieces may still be going on
+    f->buf = NULL;
+    f->start = 0;
+    f->len = 0;
+    f->scanned = 0;
+}
+
+
+/* Initialize a framer with no input */
+void init_framer(struct framer *f){
+    f->buf = NULL;
+    f->start = 0;
+    f->len = 0;
+    f->scanned = 0;
+    f->held_cr = 0;
+    f->split = 0;
+}
+
+
+/* Put back the '\r' that the end of the last piece was written over */
+static void restore_cr(struct framer *f){
+    if (f->held_cr){
+        f->buf[f->start] = '\r';
+        f->held_cr = 0;
+    }
+}
+
+
+/* Release the memory used by f */
+void free_framer(struct framer *f){
+    give_back_buf(f);
+}
+
+
+/* Read from fd into the free space of f.
+ * Return the number of bytes read, 0 at end of file, -2 if reading would
+ * block and -1 on error.
+ */
+int framer_read(struct framer *f, int fd){
+    take_buf(f);
+    restore_cr(f);
+
+    // Move a partial line to the front to make room after it
+    if (f->start > 0){
+        memmove(f->buf, f->buf + f->start, f->len);
+        f->start = 0;
+    }
+
+    int num_read = read(fd, f->buf + f->len, MAX_BUF - f->len);
+    if (num_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+        return -2;
+    }
+    if (num_read > 0){
+        f->len += num_read;
+    } else if (f->len == 0){
+        give_back_buf(f);
+    }
+    return num_read;
+}
+
+
+/* Copy as many of the count bytes at buf into the free space of f as fit,
+ * for input that was received without framer_read.
+ * Return the number of bytes taken.
+ */
+int framer_feed(struct framer *f, const char *buf, int count){
+    take_buf(f);
+    restore_cr(f);
+    if (f->start > 0){
+        memmove(f->buf, f->buf + f->start, f->len);
+        f->start = 0;
+    }
+    if (count > MAX_BUF - f->len){
+        count = MAX_BUF - f->len;
+    }
+    memcpy(f->buf + f->len, buf, count);
+    f->len += count;
+    return count;
+}
+
+
+/* Return the next complete line in f with its network newline replaced by
+ * a null terminator, or NULL if there is none yet. The line stays valid
+ * until f is used again.
+ * A line that does not fit in the buffer is handed out in pieces of up to
+ * MAX_BUF bytes. A '\r' at the end of a piece is kept for the next one,
+ * since it may be the start of the network newline, and the newline that
+ * ends such a line does not make an empty line of its own.
+ */
+char *framer_next_line(struct framer *f){
+    // The caller is done with the last line, so the buffer can go back
+    // to the pool if nothing else is in it
+    restore_cr(f);
+    if (f->len == 0){
+        give_back_buf(f);
+        return NULL;
+    }
+
+    char *begin = f->buf + f->start;
+    char *nl = NULL;
+
+    // Search only the bytes that arrived since the last search. A '\r' at
+    // the end of them may still be followed by '\n', so it is searched again.
+    int from = f->scanned > 0 ? f->scanned - 1 : 0;
+    char *p = begin + from;
+    while ((p = memchr(p, '\n', f->len - (p - begin))) != NULL){
+        if (p > begin && p[-1] == '\r'){
+            nl = p - 1;
+            break;
+        }
+        p++;
+    }
+
+    if (nl != NULL){
+        int line_len = nl - begin;
+        *nl = '\0';
+        f->start += line_len + 2;
+        f->len -= line_len + 2;
+        if (line_len == 0 && f->split){
+            // The end of a line that was handed out in pieces
+            f->split = 0;
+            f->scanned = 0;
+            return framer_next_line(f);
+        }
+        f->split = 0;
+    } else if (f->len == MAX_BUF){
+        // framer_read has moved the line to the front of buf
+        int piece = begin[MAX_BUF - 1] == '\r' ? MAX_BUF - 1 : MAX_BUF;
+        begin[piece] = '\0';
+        f->start = piece;
+        f->len = MAX_BUF - piece;
+        f->held_cr = piece < MAX_BUF;
+        f->split = 1;
+    } else {
+        f->scanned = f->len;
+        return NULL;
+    }
+
+    f->scanned = 0;
+    if (f->len == 0){
+        f->start = 0;
+    }
+    return begin;
+}
@@ -0,0 +1,30 @@
+#ifndef _FRAMER_H_
+#define _FRAMER_H_
+
+#define MAX_BUF 256
+#define MAX_POOLED_BUFS 1024
+
+/* Splits the bytes read from a client into lines ending in a network
+ * newline ("\r\n"). Bytes already searched for a newline are never searched
+ * again, and every complete line in a read is handed out in turn, so
+ * clients can send several lines at once.
+ *
+ * Most clients have no partial line most of the time, so the buffer is only
+ * taken from a pool of the worker thread while there is input in it.
+ */
+struct framer {
+    char *buf;                // MAX_BUF + 1 bytes of input, or NULL
+    int start;                // Index in buf of the first byte not yet handed out
+    int len;                  // Number of bytes in buf after start
+    int scanned;              // Number of bytes after start known to hold no "\r\n"
+    int held_cr;              // 1 if the '\r' at start ended the last piece handed out
+    int split;                // 1 if the last line handed out was a piece of a longer one
+};
+
+void init_framer(struct framer *f);
+int framer_read(struct framer *f, int fd);
+int framer_feed(struct framer *f, const char *buf, int count);
+char *framer_next_line(struct framer *f);
+void free_framer(struct framer *f);
+
+#endif
@@ -4,357 +4,525 @@
 #include <string.h>
 
 #include "game.h"
+#include "engine.h"
+#include "metrics.h"
+#include "log.h"
+#include "uring.h"
+#include "scores.h"
+#include "proto.h"
+#include "record.h"
+
+
+/* The status message of a room, which is brought up to date by
+ * update_status when it is sent after letters were guessed, rather than
+ * rendered again:
+ *     STATUS_HEAD, the word as shown, "\r\nGuesses remaining: N",
+ *     STATUS_LETTERS, each letter guessed and a space, STATUS_TAIL
+ */
+#define STATUS_HEAD "***************\r\nWord to guess: "
+#define STATUS_LETTERS "\r\nLetters guessed: \r\n"
+#define STATUS_TAIL "\r\n***************\r\n"
+#define STATUS_SIZE (2 * MAX_MSG)
 
 
-/* Search the first count characters of buf for a network newline and return the index of '\r'
-* or -1 if no network newline is found.
-*/
-int find_network_newline(const char *buf, int count){
-    for (int i = 0; i < count-1; i++){
-        if (buf[i] == '\r' && buf[i+1] == '\n'){
-            return i;
-        }
+/* The player who has the turn gets turn_timeout seconds to guess before
+ * the turn moves on. A timeout of 0 disables it.
+ */
+int turn_timeout = DEFAULT_TURN_TIMEOUT;
+
+
+/* Add p to the head of the list of clients top */
+void link_client(struct client **top, struct client *p){
+    p->prev = NULL;
+    p->next = *top;
+    if (*top != NULL){
+        (*top)->prev = p;
     }
-    return -1;
+    *top = p;
 }
 
 
-/* Read from player->fd to *buf count bytes.
+/* Remove p from the list of clients top in constant time.
+ * p->next is left as it was, so a loop over the list that is currently at
+ * p can still move on to the next client.
+ */
+void unlink_client(struct client **top, struct client *p){
+    if (p->prev != NULL){
+        p->prev->next = p->next;
+    } else if (*top == p){
+        *top = p->next;
+    }
+    if (p->next != NULL){
+        p->next->prev = p->prev;
+    }
+    p->prev = NULL;
+}
+
+
+/* Make the next line sent by player available in player->line.
 Preconditions: Calling this function would not block read().
-- If the read ends in a network newline '\r\n':
-        - replace it with '\0\0'
+- If a complete line has been received, with or without reading:
+        - point player->line to it, without its network newline
         - return 0.
-- If the read does not end in a network newline:
-        - set player->in_ptr to point to '\r\n'
-        - retu***************
-rn number of bytes read.
-- On error:
-        - call leave_handler
+- If the read does not complete a line:
+        - return number of bytes read.
+- If the socket has no more data to read, or with io_uring or in a replay,
+  no complete line has been received:
+        - return -2.
+- On error or end of file:
         - return -1.
 */
-int game_read(struct game_state *game, struct client *player, char *buf, size_t count){
-    int num_read = read(player->fd, player->in_ptr, count);
-    printf("[%d] Read %d bytes\n", player->fd, num_read);
-    int net_nl = find_network_newline(player->in_ptr, MAX_BUF);
-    if (net_nl != -1){
-        printf("[%d] Found newline %s", player->fd, player->in_ptr);
+int read_line(struct client *player){
+    player->line = framer_next_line(&player->in);
+    if (player->line != NULL){
+        return 0;
+    }
+    // With io_uring or in a replay, the event loop hands input to the framer
+    if (use_io_uring || replaying){
+        return -2;
     }
 
-    // If reading was unsuccessful
+    int num_read = framer_read(&player->in, player->fd);
+    metrics_add(CTR_SYSCALLS, 1);
+    if (num_read == -2){
+        return -2;
+    }
+    log_debug("[%d] Read %d bytes", player->fd, num_read);
     if (num_read <= 0){
-        leave_handler(game, player);
         return -1;
-    // If network newline was not found
-    } else if (net_nl == -1){
-        player->in_ptr += num_read;
-    } else {
-        player->in_ptr[net_nl] = '\0';
-        player->in_ptr[net_nl+1] = '\0';
-        player->in_ptr = player->inbuf;
+    }
+    record_event(REC_INPUT, player->conn, player->in.buf + player->in.len - num_read, num_read);
+
+    player->line = framer_next_line(&player->in);
+    if (player->line != NULL){
+        log_debug("[%d] Found newline %s", player->fd, player->line);
         return 0;
     }
     return num_read;
 }
 
 
-/* Write to player->fd count bytes starting from the location at buf.
-    - Returns similar values as per write(), but calls leave_handler when an error occured.
+/* Clients that have been written to during the current tick of the event
+ * loop. Their output is sent with one writev per client by the event loop
+ * once the tick is over.
+ */
+__thread struct client *dirty_clients = NULL;
+
+
+/* Write count bytes starting from the location at buf to player->fd, where
+ * buf stays valid until the end of the tick: it was returned by tick_copy, or
+ * is a string literal. Many players can share the same buf.
+    - The bytes are sent at the end of the tick, together with everything
+      else written to player during it.
+    - Returns count, or -1 if the player has left or is too slow to keep up
+      with the game. A player who is too slow is marked as lagging, and is
+      disconnected by the event loop once the tick is over rather than in
+      the middle of a broadcast.
 */
-int game_write(struct game_state *game, struct client *player, char *buf, size_t count){
-    int num_write = write(player->fd, buf, count);
-    if (num_write == -1){
-        leave_handler(game, player);
+int client_write_shared(struct client *player, const char *buf, size_t count){
+    if (player->fd == -1){
+        return -1;
+    }
+    int was_idle = player->out.first == NULL && !player->lagging;
+    int num_write = count;
+    if (queue_defer(&player->out, buf, count) == -1){
+        player->lagging = 1;
+        num_write = -1;
+    }
+    if (was_idle){
+        player->next_dirty = dirty_clients;
+        dirty_clients = player;
     }
     return num_write;
 }
 
 
-/* Send the message in outbuf to all clients */
-void broadcast(struct game_state *game, char *outbuf){
+/* Write count bytes starting from the location at buf to player->fd.
+    - Returns similar values as client_write_shared(), but buf can be reused
+      as soon as this returns.
+    - A player who uses the binary protocol gets buf as an OP_TEXT frame.
+*/
+int client_write(struct client *player, const char *buf, size_t count){
+    if (player->fd == -1){
+        return -1;
+    }
+    if (player->binary){
+        char *frame = tick_alloc(FRAME_HEADER + count);
+        int len = frame_text(frame, buf, count);
+        return client_write_shared(player, frame, len) == -1 ? -1 : (int) count;
+    }
+    return client_write_shared(player, tick_copy(buf, count), count);
+}
+
+
+/* Count a message to a whole room, that queued bytes over all recipients */
+static void count_broadcast(long bytes){
+    metrics_add(CTR_BROADCASTS, 1);
+    metrics_add(CTR_BROADCAST_BYTES, bytes);
+    metrics_record(&metrics->broadcast_size, bytes);
+}
+
+
+/* Send the text_len bytes of text to the players of game who use the text
+ * protocol, and the frame_len bytes of frame to those who use the binary
+ * protocol. Both can be shared as per client_write_shared(). Either can be
+ * NULL when those players already know what it says.
+ */
+static void broadcast_event(struct game_state *game, const char *text, int text_len,
+        const char *frame, int frame_len){
+    long sent = 0;
     struct client *curr = game->head;
     while (curr != NULL){
-        game_write(game, curr, outbuf, strlen(outbuf));
+        const char *buf = curr->binary ? frame : text;
+        int len = curr->binary ? frame_len : text_len;
+        if (buf != NULL && client_write_shared(curr, buf, len) != -1){
+            sent += len;
+        }
         curr = curr->next;
     }
+    count_broadcast(sent);
 }
 
 
-/* Move the has_next_turn pointer to the next active client */
-void advance_turn(struct game_state *game){
-    // If first person was added/reached end of the list
-    if (game->has_next_turn == NULL || game->has_next_turn->next == NULL){
-        game->has_next_turn = game->head;
-    } else {
-        game->has_next_turn = game->has_next_turn->next;
-    }
+/* Same as broadcast_event, but text and frame are copied first, so they
+ * can be reused as soon as this returns.
+ */
+static void broadcast_copy(struct game_state *game, const char *text, int text_len,
+        const char *frame, int frame_len){
+    broadcast_event(game, text != NULL ? tick_copy(text, text_len) : NULL, text_len,
+        frame != NULL ? tick_copy(frame, frame_len) : NULL, frame_len);
+}
+
 
-    // Display to server who's turn it is
-    if (game->has_next_turn != NULL){
-        printf("It's %s's turn\n", game->has_next_turn->name);
+/* Give the player who has the turn another turn_timeout seconds to guess */
+void restart_turn_timer(struct game_state *game){
+    if (game->has_next_turn != NULL && turn_timeout > 0){
+        arm_timer(&game->turn_timer, turn_timeout * 1000L);
+    } else {
+        cancel_timer(&game->turn_timer);
     }
 }
 
 
 /* Announce to all active players who's turn it is, and prompt the person to guess
 */
-void announce_turn(struct game_state *game){
+static void announce_turn(struct game_state *game){
     char turn_msg[MAX_MSG];
+    char frame[MAX_FRAME];
     // Message for player with current turn
-    char *your_turn = "Your guess?\r\n";
+    static const char your_turn[] = "Your guess?\r\n";
+    if (game->has_next_turn == NULL){
+        return;
+    }
 
     // Message for other players
-    if (game->has_next_turn != NULL){
-        sprintf(turn_msg, "It's %s's turn\r\n", game->has_next_turn->name);
-    }
+    int len = sprintf(turn_msg, "It's %s's turn\r\n", game->has_next_turn->name);
+    const char *msg = tick_copy(turn_msg, len);
+    int frame_len = frame_turn(frame, 0, game->has_next_turn->name);
+    const char *others = tick_copy(frame, frame_len);
+    frame_turn(frame, 1, game->has_next_turn->name);
+    const char *yours = tick_copy(frame, frame_len);
 
     // Broadcast custom message
+    long sent = 0;
     struct client *curr = game->head;
     while (curr != NULL){
-        if (curr != game->has_next_turn){
-            game_write(game, curr, turn_msg, strlen(turn_msg));
+        const char *buf;
+        int count;
+        if (curr->binary){
+            buf = curr == game->has_next_turn ? yours : others;
+            count = frame_len;
+        } else if (curr != game->has_next_turn){
+            buf = msg;
+            count = len;
         } else {
-            game_write(game, curr, your_turn, strlen(your_turn));
+            buf = your_turn;
+            count = sizeof(your_turn) - 1;
+        }
+        if (client_write_shared(curr, buf, count) != -1){
+            sent += count;
         }
         curr = curr->next;
     }
+    count_broadcast(sent);
+}
+
+
+/* Bring game->status up to date with the letters guessed since it was last
+ * sent, rendering it if the room has yet to send one. A new game renders
+ * it from scratch when EV_NEW_GAME is delivered.
+ */
+static void refresh_status(struct game_state *game) {
+    if (game->status == NULL) {
+        render_status(game);
+        return;
+    }
+    uint32_t letters;
+    while ((letters = game->guessed & ~game->status_guessed) != 0) {
+        update_status(game, 'a' + __builtin_ctz(letters));
+    }
 }
 
 
 /* Announce to the status of the game to player.
-*   - If player is NULL, the message is broadcast to everyone.
+*   - If player is NULL, the message is broadcast to everyone who uses the
+*     text protocol. Players who use the binary protocol have already been
+*     sent what changed.
+*   - A player who uses the binary protocol is sent an OP_STATE frame.
+*  The status message is shared by every recipient as it is.
 */
-void announce_status(struct game_state *game, struct client *player){
-    // Announce to everyone the status message of the game.
-    char status_msg[MAX_MSG];
-    status_message(status_msg, game);
+static void announce_status(struct game_state *game, struct client *player){
+    refresh_status(game);
+    struct message *status = game->status;
 
     if (player == NULL){
         // Announce to everyone the status message of the game.
-        broadcast(game, status_msg);
+        broadcast_event(game, tick_share(status), status->len, NULL, 0);
+    } else if (player->binary){
+        char frame[MAX_FRAME];
+        int len = frame_state(frame, OP_STATE, game);
+        client_write_shared(player, tick_copy(frame, len), len);
     } else {
-        game_write(game, player, status_msg, strlen(status_msg));
+        client_write_shared(player, tick_share(status), status->len);
     }
 
 }
 
 
-/* Announce to all players who the winner is. */
-void announce_winner(struct game_state *game, struct client *winner){
-    char *you_win = "You won!\r\n";
+/* Announce to all players who the winner of the game of word is. */
+static void announce_winner(struct game_state *game, struct client *winner, const char *word){
+    static const char you_win[] = "You won!\r\n";
     char winner_msg[MAX_MSG];
-    sprintf(winner_msg, "You lost. %s is the winner!\r\n", winner->name);
-
+    char frame[MAX_FRAME];
+    int len = sprintf(winner_msg, "You lost. %s is the winner!\r\n", winner->name);
+    const char *msg = tick_copy(winner_msg, len);
+    int frame_len = frame_game_over(frame, 0, word, winner->name);
+    const char *lost = tick_copy(frame, frame_len);
+    frame_game_over(frame, 1, word, winner->name);
+    const char *won = tick_copy(frame, frame_len);
+
+    long sent = 0;
     struct client *curr = game->head;
     while (curr != NULL){
-        if (curr != winner){
-            game_write(game, curr, winner_msg, strlen(winner_msg));
+        const char *buf;
+        int count;
+        if (curr->binary){
+            buf = curr == winner ? won : lost;
+            count = frame_len;
+        } else if (curr != winner){
+            buf = msg;
+            count = len;
         } else {
-            game_write(game, curr, you_win, strlen(you_win));
+            buf = you_win;
+            count = sizeof(you_win) - 1;
+        }
+        if (client_write_shared(curr, buf, count) != -1){
+            sent += count;
         }
         curr = curr->next;
     }   
+    count_broadcast(sent);
 }
 
 
-/* Process the guess of player.
-*  Prerequisite: player->inbuf[0] is a valid lower case letter to guess
-*/
-void guess_char(struct game_state *game, struct client *player){
-    char chr_msg[MAX_MSG];
-    int word_len = strlen(game->word);
-    int fail = 1;
-
-    // Broadcast that someone guessed a letter
-    sprintf(chr_msg, "%s guesses: %c\r\n", player->name, player->inbuf[0]);
-    broadcast(game, chr_msg);
-    game->letters_guessed[player->inbuf[0] - 'a'] = 1;
-
-    // Update word->guess
-    for (int i = 0; i < word_len; i++){
-        if (game->word[i] == player->inbuf[0]){
-            game->guess[i] = game->word[i];
-            fail = 0;
+/* Answer line, sent by player, if it is one of the commands
+ *    stats [NAME]  the wins, losses and guesses of NAME, or of player
+ *    top           the TOP_PLAYERS players with the most wins
+ * from the totals kept by scores.c, which leaves the game as it is.
+ * Return 1 if the line was one of them, 0 otherwise.
+ */
+int answer_scores(struct client *player, const char *line){
+    char msg[(TOP_PLAYERS + 1) * MAX_MSG];
+    int len = 0;
+    struct score score;
+
+    if (strcmp(line, "stats") == 0 || strncmp(line, "stats ", 6) == 0){
+        const char *name = line[5] == ' ' ? line + 6 : player->name;
+        if (lookup_score(name, &score)){
+            len = sprintf(msg, "%s: %u wins, %u losses, %u guesses\r\n",
+                score.name, score.wins, score.losses, score.guesses);
+        } else {
+            len = sprintf(msg, "%.*s has not finished a game yet\r\n", MAX_NAME, name);
+        }
+    } else if (strcmp(line, "top") == 0){
+        struct score leaders[TOP_PLAYERS];
+        int count = top_scores(leaders);
+        len = sprintf(msg, count > 0 ? "Most wins:\r\n" : "Nobody has won yet\r\n");
+        for (int i = 0; i < count; i++){
+            len += sprintf(msg + len, "%2d. %s: %u wins, %u losses\r\n", i + 1,
+                leaders[i].name, leaders[i].wins, leaders[i].losses);
         }
-    }
-    
-    // Handle failed guesses
-    if (fail == 1){
-        printf("Letter %c is not in the word\n", player->inbuf[0]);
-        sprintf(chr_msg, "Letter %c is not in the word\r\n", player->inbuf[0]);
-        broadcast(game, chr_msg);
-        game->guesses_left--;
-        advance_turn(game);
-    // Handle successful guesses
-    } else {
-        printf("Letter %c is in the word\n", player->inbuf[0]);
-        sprintf(chr_msg, "Letter %c is a correct guess!\r\n", player->inbuf[0]);
-        broadcast(game, chr_msg);        
-    }
-
-}
-
-
-/* Processes input of the player who has the current turn.
-    - If game_read returns an error, return -1.
-    - If guess is invalid, inform the player and return 1.
-    - If the guess is valid, return 0.
-*/
-int process_turn_input(struct game_state *game, struct client *player){
-    int read_status = game_read(game, player, player->in_ptr, MAX_BUF);
-    char guess_msg[MAX_MSG];
-    guess_msg[0] = '\0';
-
-    if (read_status != 0){
-        return -1;
-    } else if (strlen(player->in_ptr) == 0){
-        sprintf(guess_msg, "Enter something non-empty...\r\n");
-    } else if (strlen(player->in_ptr) > 1){
-        sprintf(guess_msg, "That guess is too long. Input just one character\r\n");
-    } else if ('a' > player->inbuf[0] || player->inbuf[0] > 'z'){
-        sprintf(guess_msg, "Enter a lowercase letter...\r\n");
-    } else if (game->letters_guessed[player->inbuf[0] - 'a'] == 1){
-        sprintf(guess_msg, "That letter has already been guessed...\r\n");
-    }
-    // If it failed any of the above conditions,
-    if (strlen(guess_msg) > 0){
-        game_write(game, player, guess_msg, strlen(guess_msg));
-        return 1;
     } else {
-        guess_char(game, player);
         return 0;
     }
+    client_write(player, msg, len);
+    return 1;
 }
 
 
-/* Checks if game is finished, and broadcast appropriate messages.
-- Returns 1 if game is not over
-- Returns 0 if game is over 
-*/
-int check_game_over(struct game_state *game, struct client *curr_player){
-    /* Game over conditions (guesses_left == 0 or word successfully guessed) are mutually exclusive
-       since guesses_left does not decrease when a letter is guessed successfully
-    */ 
-
-    // Check if there are no more guesses
-    char game_over_msg[MAX_MSG];
-    if (game->guesses_left == 0){
-        printf("Evaluated game over due to zero remaining guesses\n");
-        sprintf(game_over_msg, "No more guesses. The word was %s.\r\n", game->word);
-        broadcast(game, game_over_msg);
-        return 0;
-    }
-
-    // Check if word has been guessed
-    int word_len = strlen(game->word);
-    for (int i = 0; i < word_len; i++){
-        if (game->guess[i] == '-'){
-            return 1;
+/* Tell the players of game what the engine reported in out, each in the
+ * protocol they use, and empty out. Nothing here disconnects anyone: a
+ * player who falls too far behind is dropped by the event loop once the
+ * tick is over (see client_write_shared), so game->head does not change
+ * while the events are delivered.
+ */
+void deliver_events(struct game_state *game, struct game_events *out){
+    static const char new_game_msg[] = "STARTING NEW GAME\r\n";
+    char msg[MAX_MSG];
+    char frame[MAX_FRAME];
+    int len, frame_len;
+
+    for (int i = 0; i < out->len; i++){
+        struct game_event *e = &out->events[i];
+        const char *name = e->player != NULL ? e->player->name : "";
+        switch (e->type){
+        case EV_TEXT:
+            if (e->player != NULL){
+                client_write(e->player, e->text, e->len);
+            } else {
+                // Players who use the binary protocol get an OP_TEXT frame
+                char *text_frame = tick_alloc(FRAME_HEADER + e->len);
+                frame_len = frame_text(text_frame, e->text, e->len);
+                broadcast_event(game, tick_copy(e->text, e->len), e->len, text_frame,
+                    frame_len);
+            }
+            break;
+        case EV_JOIN:
+            len = sprintf(msg, "%s has entered the game!\r\n", name);
+            frame_len = frame_name(frame, OP_JOIN, name);
+            broadcast_copy(game, msg, len, frame, frame_len);
+            break;
+        case EV_LEAVE:
+            len = sprintf(msg, "\r\n%s has left the game\r\n", name);
+            frame_len = frame_name(frame, OP_LEAVE, name);
+            broadcast_copy(game, msg, len, frame, frame_len);
+            break;
+        case EV_TIMEOUT:
+            log_info("[room %d] %s ran out of time", game->id, name);
+            len = sprintf(msg, "%s ran out of time\r\n", name);
+            frame_len = frame_name(frame, OP_TIMEOUT, name);
+            broadcast_copy(game, msg, len, frame, frame_len);
+            break;
+        case EV_GUESS:
+            // Players who use the binary protocol get a single frame with
+            // the outcome
+            log_debug("[room %d] Letter %c is %sin the word", game->id, e->letter,
+                e->hit ? "" : "not ");
+            len = sprintf(msg, "%s guesses: %c\r\n", name, e->letter);
+            broadcast_copy(game, msg, len, NULL, 0);
+            if (e->hit){
+                len = sprintf(msg, "Letter %c is a correct guess!\r\n", e->letter);
+            } else {
+                len = sprintf(msg, "Letter %c is not in the word\r\n", e->letter);
+            }
+            frame_len = frame_guess(frame, e->letter, e->positions, e->guesses_left);
+            broadcast_copy(game, msg, len, frame, frame_len);
+            break;
+        case EV_GAME_OVER:
+            if (e->player == NULL){
+                log_debug("[room %d] Game over due to zero remaining guesses", game->id);
+                len = sprintf(msg, "No more guesses. The word was %s.\r\n", e->word);
+                frame_len = frame_game_over(frame, 0, e->word, "");
+                broadcast_copy(game, msg, len, frame, frame_len);
+            } else {
+                log_debug("[room %d] Game over due to %s's victory", game->id, name);
+                announce_winner(game, e->player, e->word);
+                len = sprintf(msg, "The word was %s\r\n", e->word);
+                broadcast_copy(game, msg, len, NULL, 0);
+            }
+            break;
+        case EV_NEW_GAME:
+            log_debug("[room %d] New game, with a word of length %d", game->id,
+                game->word_len);
+            render_status(game);
+            frame_len = frame_state(frame, OP_NEW_GAME, game);
+            broadcast_event(game, new_game_msg, sizeof(new_game_msg) - 1,
+                tick_copy(frame, frame_len), frame_len);
+            break;
+        case EV_STATUS:
+            announce_status(game, e->player);
+            break;
+        case EV_TURN:
+            announce_turn(game);
+            break;
+        case EV_CLOCK:
+            restart_turn_timer(game);
+            break;
+        case EV_RESULT:
+            record_result(name, e->won, e->lost, e->guesses);
+            break;
         }
     }
-    
-    announce_winner(game, curr_player);
-    printf("Evaluated game over due to %s's victory\n", curr_player->name);
-    sprintf(game_over_msg, "The word was %s\r\n", game->word);
-    broadcast(game, game_over_msg);
-    return 0;
-}
-
-
-/* Broadcasts and reinitiates the start of a new game */
-void start_new_game(struct game_state *game, char *dict_name){
-    char *new_game_msg = "STARTING NEW GAME\r\n";
-    printf("New game\n");
-    broadcast(game, new_game_msg);
-    init_game(game, dict_name);
+    clear_events(out);
 }
 
 
-/* Return a status message that shows the current state of the game.
- * Assumes that the caller has allocated MAX_MSG bytes for msg.
+/* Write the current guess (for example '-o-d') to buf, which must have
+ * room for MAX_WORD bytes, and return buf.
+ * Characters other than lowercase letters cannot be guessed, so they are
+ * shown from the start.
  */
-char *status_message(char *msg, struct game_state *game) {
-    sprintf(msg, "***************\r\n"
-           "Word to guess: %s\r\nGuesses remaining: %d\r\n"
-           "Letters guessed: \r\n", game->guess, game->guesses_left);
-    for(int i = 0; i < 26; i++){
-        if(game->letters_guessed[i]) {
-            int len = strlen(msg);
-            msg[len] = (char)('a' + i);
-            msg[len + 1] = ' ';
-            msg[len + 2] = '\0';
+char *render_guess(char *buf, struct game_state *game) {
+    for (int i = 0; i < game->word_len; i++) {
+        char c = game->word[i];
+        if (c >= 'a' && c <= 'z' && (game->guessed & LETTER_BIT(c)) == 0) {
+            buf[i] = '-';
+        } else {
+            buf[i] = c;
         }
     }
-    strncat(msg, "\r\n***************\r\n", MAX_MSG);
-    return msg;
+    buf[game->word_len] = '\0';
+    return buf;
 }
 
 
-/* Initialize the gameboard: 
- *    - initialize dictionary
- *    - select a random word to guess from the dictionary file
- *    - set guess to all dashes ('-')
- *    - initialize the other fields
- * We can't initialize head and has_next_turn because these will have
- * different values when we use init_game to create a new game after one
- * has already been played
+/* Render the status message that shows the current state of the game to
+ * game->status from scratch.
  */
-void init_game(struct game_state *game, char *dict_name) {
-    char buf[MAX_WORD];
-    if(game->dict.fp != NULL) {
-        rewind(game->dict.fp);
-    } else {
-        game->dict.fp = fopen(dict_name, "r");
-        if(game->dict.fp == NULL) {
-            perror("Opening dictionary");
-            exit(1);
-        }
-    } 
-
-    int index = random() % game->dict.size;
-    printf("Looking for word at index %d\n", index);
-    for(int i = 0; i <= index; i++) {
-        if(!fgets(buf, MAX_WORD, game->dict.fp)){
-            fprintf(stderr,"File ended before we found the entry index %d",index);
-            exit(1);
-        }
-    } 
-
-    // Found word
-    if(buf[strlen(buf) - 1] == '\n') {  // from a unix file
-        buf[strlen(buf) - 1] = '\0';
-    } else {
-        fprintf(stderr, "The dictionary file does not appear to have Unix line endings\n");
-    }
-    strncpy(game->word, buf, MAX_WORD);
-    game->word[MAX_WORD-1] = '\0';
-    for(int j = 0; j < strlen(game->word); j++) {
-        game->guess[j] = '-';
+void render_status(struct game_state *game) {
+    if (game->status == NULL) {
+        game->status = new_message(STATUS_SIZE);
     }
-    game->guess[strlen(game->word)] = '\0';
-
-    for(int i = 0; i < NUM_LETTERS; i++) {
-        game->letters_guessed[i] = 0;
+    game->status = edit_message(game->status);
+    char *msg = game->status->data;
+    char guess[MAX_WORD];
+    int len = sprintf(msg, STATUS_HEAD "%s\r\nGuesses remaining: %d" STATUS_LETTERS,
+        render_guess(guess, game), game->guesses_left);
+    game->status_letters = len;
+    for(int i = 0; i < NUM_LETTERS; i++){
+        if(game->guessed & ((uint32_t) 1 << i)) {
+            msg[len++] = (char)('a' + i);
+            msg[len++] = ' ';
+        }
     }
-    game->guesses_left = MAX_GUESSES;
-
+    memcpy(msg + len, STATUS_TAIL, sizeof(STATUS_TAIL) - 1);
+    game->status->len = len + sizeof(STATUS_TAIL) - 1;
+    game->status_guessed = game->guessed;
 }
 
 
-/* Return the number of lines in the file
+/* Bring game->status up to date once letter has been guessed: show it
+ * where it is in the word, add it to the letters guessed, in alphabetical
+ * order, and write the guesses remaining over the old count. A copy is
+ * only made if the status was already written during this tick.
  */
-int get_file_length(char *filename) {
-    char buf[MAX_MSG];
-    int count = 0;
-    FILE *fp;
-    if((fp = fopen(filename, "r")) == NULL) {
-        perror("open");
-        exit(1);
+void update_status(struct game_state *game, char letter) {
+    // Only a single digit count can be written over
+    if (game->guesses_left >= 9) {
+        render_status(game);
+        return;
     }
-    
-    while(fgets(buf, MAX_MSG, fp) != NULL) {
-        count++;
+    struct message *m = game->status = edit_message(game->status);
+    for (uint32_t at = game->positions[letter - 'a']; at != 0; at &= at - 1) {
+        m->data[sizeof(STATUS_HEAD) - 1 + __builtin_ctz(at)] = letter;
     }
-    
-    fclose(fp);
-    return count;
+    m->data[game->status_letters - sizeof(STATUS_LETTERS)] = '0' + game->guesses_left;
+
+    int before = __builtin_popcount(game->status_guessed & (LETTER_BIT(letter) - 1));
+    int at = game->status_letters + 2 * before;
+    memmove(m->data + at + 2, m->data + at, m->len - at);
+    m->data[at] = letter;
+    m->data[at + 1] = ' ';
+    m->len += 2;
+    game->status_guessed |= LETTER_BIT(letter);
 }
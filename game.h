@@ -1,54 +1,103 @@
+#ifndef _GAME_H_
+#define _GAME_H_
+
 #include <netinet/in.h>
+#include <stdint.h>
+
+#include "dict.h"
+#include "queue.h"
+#include "framer.h"
+#include "timer.h"
+#include "names.h"
 
 #define MAX_NAME 30  
 #define MAX_MSG 128
-#define MAX_WORD 20
-#define MAX_BUF 256
+#define MAX_WORD (DICT_MAX_LEN + 1)
 #define MAX_GUESSES 4
 #define NUM_LETTERS 26
+#define LETTER_BIT(c) ((uint32_t) 1 << ((c) - 'a'))
 #define WELCOME_MSG "Welcome to our word game. What is your name?\r\n"
+#define DEFAULT_TURN_TIMEOUT 60
+#define RECENT_WORDS 32      // Words a room remembers so as not to repeat them
+#define RECENT_TRIES 8       // Words picked before a recent one is allowed
 
+/* The fields used on every event and broadcast come first, so that they
+ * share as few cache lines as possible; the rest is only used when a client
+ * joins, leaves or is named in a message.
+ */
 struct client {
-    int fd;
-    struct in_addr ipaddr;
+    int fd;               // -1 once the client has been disconnected
+    int active;           // 1 once the client has a name and is in game->head
+    int binary;           // 1 once the client has switched to proto.h frames
+    int lagging;          // 1 once its output exceeded max_backlog this tick
     struct client *next;
-    char name[MAX_NAME];
-    char inbuf[MAX_BUF];  // Used to hold input from the client
-    char *in_ptr;         // A pointer into inbuf to help with partial reads
-};
+    struct client *prev;      // NULL at the head of the list
+    struct game_state *game;  // The room the client plays in, once active
+    char *line;           // The line being handled, inside in
+    struct framer in;     // Splits input from the client into lines
+    struct out_queue out; // Output waiting for the socket to become writable
+    struct client *next_dirty; // Link in dirty_clients
+    struct timer timer;   // Disconnects the client if it takes too long
+    struct timer stall_timer; // Disconnects the client if it stops reading
+    int guesses;          // Valid guesses made in the current game
 
-// Information about the dictionary used to pick random word
-struct dictionary {
-    FILE *fp;
-    int size;
+    struct client *next_dead; // Link in the list of clients waiting to be freed
+    int uring_ops;        // io_uring operations on fd that have not completed
+    unsigned conn;        // Number of the connection on its worker, see record.h
+    struct in_addr ipaddr;
+    unsigned name_id;     // Registered in names.c, or NO_NAME until named
+    const char *name;     // name_str(name_id), kept to format messages with
 };
 
 struct game_state {
     char word[MAX_WORD];      // The word to guess
-    char guess[MAX_WORD];     // The current guess (for example '-o-d')
-    int letters_guessed[NUM_LETTERS]; // Index i will be 1 if the corresponding
-                                      // letter has been guessed; 0 otherwise
-    int guesses_left;         // Number of guesses remaining
-    struct dictionary dict;
+    // Bit i of each mask stands for the letter 'a' + i (see LETTER_BIT)
+    uint32_t guessed;         // Letters that have been guessed
+    uint32_t in_word;         // Letters that appear in word
+    uint32_t positions[NUM_LETTERS]; // Bit i is set if the letter is at position i
+    uint32_t remaining;       // Letters of word that have not been guessed yet
+    unsigned char word_len;
+    unsigned char guesses_left; // Number of guesses remaining
+    unsigned char status_letters; // Where the letters guessed start in status
+    uint32_t status_guessed;  // The letters guessed that status shows
+    struct message *status;   // The status message, see render_status
+    struct dictionary *dict;  // The dictionary version word came from, or NULL
+    enum band band;           // The band words are picked from
+    unsigned recent[RECENT_WORDS]; // Indexes in dict of the last words picked
+    unsigned num_recent;      // Words picked from dict so far
     
     struct client *head;
     struct client *has_next_turn;
+    struct timer turn_timer;  // Moves the turn on if has_next_turn takes too long
+
+    // Room bookkeeping, maintained by room.c
+    int id;                   // Used to tell rooms apart in server output
+    int num_players;          // Number of clients in head
+    struct game_state *prev_room;    // Links in the list of every room
+    struct game_state *next_room;
+    struct game_state *prev_open;    // Links in the list of rooms with space
+    struct game_state *next_open;
+    struct game_state *next_retired; // Link in the list of rooms to be freed
 };
 
 
+struct game_events;
+
 void leave_handler(struct game_state *game, struct client *player);
-int find_network_newline(const char *buf, int count);
-int game_read(struct game_state *game, struct client *player, char *buf, size_t count);
-int game_write(struct game_state *game, struct client *player, char *buf, size_t count);
-void broadcast(struct game_state *game, char *outbuf);
-void advance_turn(struct game_state *game);
-void announce_turn(struct game_state *game);
-void announce_status(struct game_state *game, struct client *player);
-void announce_winner(struct game_state *game, struct client *winner);
-void guess_char(struct game_state *game, struct client *player);
-int process_turn_input(struct game_state *game, struct client *player);
-int check_game_over(struct game_state *game, struct client *curr_player);
-void start_new_game(struct game_state *game, char *dict_name);
-void init_game(struct game_state *game, char *dict_name);
-int get_file_length(char *filename);
-char *status_message(char *msg, struct game_state *game);
+void turn_expired(struct timer *t);
+void link_client(struct client **top, struct client *p);
+void unlink_client(struct client **top, struct client *p);
+int read_line(struct client *player);
+extern __thread struct client *dirty_clients;
+extern int turn_timeout;
+
+int client_write_shared(struct client *player, const char *buf, size_t count);
+int client_write(struct client *player, const char *buf, size_t count);
+void restart_turn_timer(struct game_state *game);
+int answer_scores(struct client *player, const char *line);
+void deliver_events(struct game_state *game, struct game_events *out);
+char *render_guess(char *buf, struct game_state *game);
+void render_status(struct game_state *game);
+void update_status(struct game_state *game, char letter);
+
+#endif
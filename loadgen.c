@@ -0,0 +1,471 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "network.h"
+#include "game.h"
+#include "metrics.h"
+#include "proto.h"
+
+/* A load generator for the server. It opens many connections at once from
+ * a single thread, gives each a name and plays a random unguessed letter
+ * whenever it is asked for a guess, then reports how fast the server kept
+ * up. With --binary, the bots use the binary protocol of proto.h.
+ */
+
+#ifndef PORT
+    #define PORT 54261
+#endif
+#define DEFAULT_CONNECTIONS 100
+#define DEFAULT_DURATION 10
+#define MAX_EVENTS 256
+#define FRAME_BUF 1024
+
+enum bot_state {
+    BOT_CONNECTING,           // Waiting for connect to complete
+    BOT_NAMING,               // Waiting for its name to be accepted
+    BOT_PLAYING,
+    BOT_CLOSED
+};
+
+/* One simulated player */
+struct bot {
+    int fd;
+    enum bot_state state;
+    char name[MAX_NAME];
+    uint32_t guessed;         // Letters guessed by anyone in the current game
+    char last_guess;
+    uint64_t connect_start;
+    uint64_t guess_sent;      // When the pending guess was sent, or 0
+    struct framer in;
+    int binary;               // 1 once the bot has asked for binary frames
+    char frames[FRAME_BUF];   // Frames received but not yet handled
+    int frames_len;
+};
+
+/* What the run has measured so far */
+struct results {
+    long connected;           // Bots whose name was accepted
+    long failed;              // Bots that could not connect or were dropped
+    long guesses;             // Guesses echoed back by the server
+    long bytes;               // Bytes received from the server
+    uint64_t last_connect;    // When the last bot got its name accepted
+    struct histogram handshake;
+    struct histogram turn;
+};
+
+struct results results;
+int use_binary = 0;
+
+
+/* Close b's connection, counting it as failed unless the run is over */
+void close_bot(struct bot *b, int failed){
+    if (b->state == BOT_CLOSED){
+        return;
+    }
+    close(b->fd);
+    free_framer(&b->in);
+    b->state = BOT_CLOSED;
+    if (failed){
+        results.failed++;
+    }
+}
+
+
+/* Send the string msg to b.
+ * Return 0 on success, or -1 if b had to be closed.
+ */
+int bot_send(struct bot *b, const char *msg){
+    int len = strlen(msg);
+    if (write(b->fd, msg, len) != len){
+        close_bot(b, 1);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Guess a random letter that nobody has guessed yet in b's game */
+int bot_guess(struct bot *b){
+    char msg[4];
+    char letter = 'a' + random() % NUM_LETTERS;
+    if (b->guessed != (uint32_t) (1 << NUM_LETTERS) - 1){
+        while (b->guessed & LETTER_BIT(letter)){
+            letter = 'a' + random() % NUM_LETTERS;
+        }
+    }
+    b->last_guess = letter;
+    b->guess_sent = now_ns();
+    sprintf(msg, "%c\r\n", letter);
+    return bot_send(b, msg);
+}
+
+
+/* Send b's name again with a "_" added, since it was taken. The bot fails
+ * once the name would be too long for the server.
+ */
+void retry_name(struct bot *b){
+    int len = strlen(b->name);
+    if (len + 1 >= MAX_NAME){
+        close_bot(b, 1);
+        return;
+    }
+    b->name[len] = '_';
+    b->name[len + 1] = '\0';
+    bot_send(b, b->name);
+    bot_send(b, "\r\n");
+}
+
+
+/* React to one line sent by the server to b */
+void bot_handle_line(struct bot *b, const char *line){
+    int name_len = strlen(b->name);
+    int prompt_len = strlen(WELCOME_MSG) - 2;
+    char letter;
+
+    if (strncmp(line, WELCOME_MSG, prompt_len) == 0 && line[prompt_len] == '\0'){
+        if (use_binary){
+            // Nothing else is sent until the server has the request
+            b->binary = 1;
+            bot_send(b, PROTO_REQUEST "\r\n");
+        }
+        bot_send(b, b->name);
+        bot_send(b, "\r\n");
+    } else if (strncmp(line, "That name is already taken", 26) == 0){
+        retry_name(b);
+    } else if (b->state == BOT_NAMING && strncmp(line, b->name, name_len) == 0
+            && strcmp(line + name_len, " has entered the game!") == 0){
+        uint64_t now = now_ns();
+        b->state = BOT_PLAYING;
+        metrics_record(&results.handshake, now - b->connect_start);
+        results.connected++;
+        results.last_connect = now;
+    } else if (strcmp(line, "Your guess?") == 0){
+        bot_guess(b);
+    } else if (strncmp(line, "That letter has already been guessed", 36) == 0){
+        b->guessed |= LETTER_BIT(b->last_guess);
+        bot_guess(b);
+    } else if (strcmp(line, "STARTING NEW GAME") == 0){
+        b->guessed = 0;
+    } else if (sscanf(line + strcspn(line, " "), " guesses: %c", &letter) == 1
+            && letter >= 'a' && letter <= 'z'){
+        b->guessed |= LETTER_BIT(letter);
+        // The server echoes our own guess once it has been handled
+        if (b->guess_sent != 0 && strncmp(line, b->name, name_len) == 0
+                && line[name_len] == ' '){
+            metrics_record(&results.turn, now_ns() - b->guess_sent);
+            b->guess_sent = 0;
+            results.guesses++;
+        }
+    }
+}
+
+
+/* React to one frame of len bytes, opcode included, sent by the server to b */
+void bot_handle_frame(struct bot *b, const char *frame, int len){
+    const char *payload = frame + 1;
+    len--;
+    if (frame[0] == OP_TEXT && strncmp(payload, "That name is already taken", 26) == 0){
+        retry_name(b);
+    } else if (frame[0] == OP_JOIN && b->state == BOT_NAMING
+            && len == strlen(b->name) && memcmp(payload, b->name, len) == 0){
+        uint64_t now = now_ns();
+        b->state = BOT_PLAYING;
+        metrics_record(&results.handshake, now - b->connect_start);
+        results.connected++;
+        results.last_connect = now;
+    } else if (frame[0] == OP_TURN && len > 0 && payload[0] == 1){
+        bot_guess(b);
+    } else if (frame[0] == OP_TEXT && strncmp(payload, "That letter has already been guessed", 36) == 0){
+        b->guessed |= LETTER_BIT(b->last_guess);
+        bot_guess(b);
+    } else if ((frame[0] == OP_STATE || frame[0] == OP_NEW_GAME) && len >= 5){
+        uint32_t guessed;
+        memcpy(&guessed, payload + 1, sizeof(guessed));
+        b->guessed = ntohl(guessed);
+    } else if (frame[0] == OP_GUESS && len == 6 && payload[0] >= 'a' && payload[0] <= 'z'){
+        b->guessed |= LETTER_BIT(payload[0]);
+        // Only the bot whose turn it is can have a guess pending
+        if (b->guess_sent != 0 && payload[0] == b->last_guess){
+            metrics_record(&results.turn, now_ns() - b->guess_sent);
+            b->guess_sent = 0;
+            results.guesses++;
+        }
+    }
+}
+
+
+/* Read and handle every frame the server has sent to b */
+void bot_read_frames(struct bot *b){
+    while (b->state != BOT_CLOSED){
+        int start = 0;
+        while (b->state != BOT_CLOSED && b->frames_len - start >= 2){
+            int len = ((unsigned char) b->frames[start] << 8) | (unsigned char) b->frames[start + 1];
+            if (len == 0 || len > FRAME_BUF - 2){
+                close_bot(b, 1);
+                return;
+            }
+            if (b->frames_len - start < 2 + len){
+                break;
+            }
+            bot_handle_frame(b, b->frames + start + 2, len);
+            start += 2 + len;
+        }
+        if (b->state == BOT_CLOSED){
+            return;
+        }
+        memmove(b->frames, b->frames + start, b->frames_len - start);
+        b->frames_len -= start;
+
+        int num_read = read(b->fd, b->frames + b->frames_len, FRAME_BUF - b->frames_len);
+        if (num_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return;
+        }
+        if (num_read <= 0){
+            close_bot(b, 1);
+            return;
+        }
+        results.bytes += num_read;
+        b->frames_len += num_read;
+    }
+}
+
+
+/* Read and handle everything the server has sent to b */
+void bot_read(struct bot *b){
+    while (b->state != BOT_CLOSED){
+        char *line;
+        while (b->state != BOT_CLOSED && !b->binary
+                && (line = framer_next_line(&b->in)) != NULL){
+            bot_handle_line(b, line);
+        }
+        if (b->binary){
+            // Everything after the welcome is in frames
+            bot_read_frames(b);
+            return;
+        }
+        if (b->state == BOT_CLOSED){
+            return;
+        }
+        int num_read = framer_read(&b->in, b->fd);
+        if (num_read == -2){
+            return;
+        }
+        if (num_read <= 0){
+            close_bot(b, 1);
+            return;
+        }
+        results.bytes += num_read;
+    }
+}
+
+
+/* Start connecting bot number id to addr */
+void bot_connect(struct bot *b, int id, struct sockaddr_in *addr, int epfd){
+    struct epoll_event ev;
+    b->state = BOT_CONNECTING;
+    b->guessed = 0;
+    b->guess_sent = 0;
+    b->binary = 0;
+    b->frames_len = 0;
+    b->connect_start = now_ns();
+    snprintf(b->name, MAX_NAME - 4, "bot%d_%d", (int) getpid() % 1000, id);
+    init_framer(&b->in);
+
+    b->fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (b->fd < 0){
+        perror("socket");
+        b->state = BOT_CLOSED;
+        results.failed++;
+        return;
+    }
+    if (set_nonblocking(b->fd) == -1
+            || (connect(b->fd, (struct sockaddr *) addr, sizeof(*addr)) == -1
+                && errno != EINPROGRESS)){
+        perror("connect");
+        close_bot(b, 1);
+        return;
+    }
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = b;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, b->fd, &ev) == -1){
+        perror("epoll_ctl");
+        close_bot(b, 1);
+    }
+}
+
+
+/* Return the sum of every sample of the metric called name that the server
+ * reports on its admin socket at path, or -1 if it cannot be read.
+ */
+double read_metric(const char *path, const char *name){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1){
+        perror("admin socket");
+        if (fd >= 0){
+            close(fd);
+        }
+        return -1;
+    }
+    FILE *in = fdopen(fd, "r");
+    char line[256];
+    int name_len = strlen(name);
+    double total = 0;
+    while (fgets(line, sizeof(line), in) != NULL){
+        if (strncmp(line, name, name_len) == 0
+                && (line[name_len] == ' ' || line[name_len] == '{')){
+            total += strtod(strrchr(line, ' ') + 1, NULL);
+        }
+    }
+    fclose(in);
+    return total;
+}
+
+
+/* Print how many of the metric name the server counted during the run,
+ * given its value before, in total and per guess.
+ */
+void print_server_metric(const char *path, const char *label, const char *name, double before){
+    double after = read_metric(path, name);
+    if (before < 0 || after < 0){
+        return;
+    }
+    printf("%-14s %.0f (%.2f per guess)\n", label, after - before,
+        results.guesses > 0 ? (after - before) / results.guesses : 0);
+}
+
+
+/* Print the latency percentiles of h in milliseconds */
+void print_latency(const char *label, const struct histogram *h){
+    printf("%-14s p50 %.3f  p99 %.3f  p999 %.3f  max %.3f ms\n", label,
+        histogram_quantile(h, 0.5) / 1e6, histogram_quantile(h, 0.99) / 1e6,
+        histogram_quantile(h, 0.999) / 1e6, h->max / 1e6);
+}
+
+
+int main(int argc, char **argv){
+    int connections = DEFAULT_CONNECTIONS;
+    int duration = DEFAULT_DURATION;
+    int port = PORT;
+    char *host = "127.0.0.1";
+    char *admin_path = NULL;
+    struct option long_options[] = {
+        {"connections", required_argument, NULL, 'c'},
+        {"duration", required_argument, NULL, 'd'},
+        {"host", required_argument, NULL, 'h'},
+        {"port", required_argument, NULL, 'p'},
+        {"admin", required_argument, NULL, 'a'},
+        {"binary", no_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:d:h:p:a:b", long_options, NULL)) != -1){
+        switch (opt){
+        case 'c':
+            connections = strtol(optarg, NULL, 10);
+            break;
+        case 'd':
+            duration = strtol(optarg, NULL, 10);
+            break;
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = strtol(optarg, NULL, 10);
+            break;
+        case 'a':
+            admin_path = optarg;
+            break;
+        case 'b':
+            use_binary = 1;
+            break;
+        default:
+            connections = -1;
+        }
+    }
+    struct sockaddr_in *addr = init_server(port);
+    if (optind != argc || connections < 1 || duration < 1
+            || inet_pton(AF_INET, host, &addr->sin_addr) != 1){
+        fprintf(stderr, "Usage: %s [--connections N] [--duration SECONDS] "
+            "[--host ADDRESS] [--port PORT] [--admin SOCKET_PATH] [--binary]\n", argv[0]);
+        exit(1);
+    }
+
+    struct bot *bots = calloc(connections, sizeof(struct bot));
+    if (!bots){
+        perror("calloc");
+        exit(1);
+    }
+    int epfd = epoll_create1(0);
+    if (epfd == -1){
+        perror("epoll_create1");
+        exit(1);
+    }
+    srandom(getpid());
+
+    // The server's own counters show what the run cost it
+    double syscalls = -1, writes = -1;
+    if (admin_path != NULL){
+        syscalls = read_metric(admin_path, "hangman_syscalls_total");
+        writes = read_metric(admin_path, "hangman_write_calls_total");
+    }
+
+    uint64_t start = now_ns();
+    uint64_t end = start + duration * 1000000000ULL;
+    for (int i = 0; i < connections; i++){
+        bot_connect(&bots[i], i, addr, epfd);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (now_ns() < end){
+        int nready = epoll_wait(epfd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < nready; i++){
+            struct bot *b = events[i].data.ptr;
+            if (b->state == BOT_CONNECTING && (events[i].events & (EPOLLOUT | EPOLLERR))){
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(b->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0){
+                    close_bot(b, 1);
+                    continue;
+                }
+                b->state = BOT_NAMING;
+            }
+            if (b->state != BOT_CONNECTING){
+                bot_read(b);
+            }
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    for (int i = 0; i < connections; i++){
+        close_bot(&bots[i], 0);
+    }
+
+    double connect_time = results.connected > 0 ? (results.last_connect - start) / 1e9 : 0;
+    printf("connections    %ld of %d in %.3f s (%.0f/s), %ld failed\n",
+        results.connected, connections, connect_time,
+        connect_time > 0 ? results.connected / connect_time : 0, results.failed);
+    printf("guesses        %ld in %.3f s (%.0f/s)\n",
+        results.guesses, elapsed, results.guesses / elapsed);
+    printf("%-14s %ld (%.2f per guess)\n", "received", results.bytes,
+        results.guesses > 0 ? (double) results.bytes / results.guesses : 0);
+    print_latency("handshake", &results.handshake);
+    print_latency("turn", &results.turn);
+    if (admin_path != NULL){
+        print_server_metric(admin_path, "syscalls", "hangman_syscalls_total", syscalls);
+        print_server_metric(admin_path, "writes", "hangman_write_calls_total", writes);
+    }
+    return results.connected == connections ? 0 : 1;
+}
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "ring.h"
+
+#define LOG_BATCH 65536
+
+/* One log record, formatted by the thread that logged it */
+struct log_record {
+    struct timespec time;
+    int level;
+    int len;
+    char text[LOG_MSG_MAX];
+};
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+/* The records of each thread, waiting for the writer. As the thread that
+ * logs never waits, a record is dropped and counted when its ring is full.
+ */
+static struct ring_set rings = RING_SET(LOG_RING_SIZE, struct log_record);
+static __thread struct ring *ring = NULL;
+
+// Held while draining, so that log_flush can run alongside the writer
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char batch[LOG_BATCH];
+static int batch_len = 0;
+
+
+/* Queue a record at level for the writer. Use the log_* macros instead, so
+ * that records below LOG_LEVEL cost nothing.
+ */
+void log_write(int level, const char *fmt, ...){
+    struct log_record *rec = ring_reserve(&rings, &ring);
+    if (rec == NULL){
+        return;
+    }
+    va_list args;
+    clock_gettime(CLOCK_REALTIME, &rec->time);
+    rec->level = level;
+    va_start(args, fmt);
+    rec->len = vsnprintf(rec->text, LOG_MSG_MAX, fmt, args);
+    va_end(args);
+    if (rec->len >= LOG_MSG_MAX){
+        rec->len = LOG_MSG_MAX - 1;
+    }
+    ring_publish(ring);
+}
+
+
+/* Write out the batch */
+static void write_batch(void){
+    int written = 0;
+    while (written < batch_len){
+        int n = write(STDOUT_FILENO, batch + written, batch_len - written);
+        if (n <= 0){
+            break;
+        }
+        written += n;
+    }
+    batch_len = 0;
+}
+
+
+/* Add a line with the given time and level to the batch */
+static void add_line(const struct timespec *time, int level, const char *text, int len){
+    static time_t last_sec = -1;
+    static char stamp[32];
+    if (batch_len + (int) sizeof(stamp) + 8 + len + 1 > LOG_BATCH){
+        write_batch();
+    }
+    // Most records share their second with the one before
+    if (time->tv_sec != last_sec){
+        struct tm tm;
+        localtime_r(&time->tv_sec, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        last_sec = time->tv_sec;
+    }
+    batch_len += sprintf(batch + batch_len, "%s.%03ld %-5s ", stamp,
+        time->tv_nsec / 1000000, level_names[level]);
+    memcpy(batch + batch_len, text, len);
+    batch_len += len;
+    batch[batch_len++] = '\n';
+}
+
+
+/* Write every queued record, thread by thread, with as few write calls as
+ * possible. Return the number of records written.
+ */
+static int drain(void){
+    int count = 0;
+    pthread_mutex_lock(&drain_lock);
+    for (struct ring *r = first_ring(&rings); r != NULL; r = r->next){
+        unsigned long tail = r->tail;
+        unsigned long head = ring_head(r);
+        for (; tail != head; tail++){
+            struct log_record *rec = ring_record(r, tail);
+            add_line(&rec->time, rec->level, rec->text, rec->len);
+            count++;
+        }
+        ring_consume(r, tail);
+
+        long dropped = ring_take_dropped(r);
+        if (dropped > 0){
+            char msg[64];
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            int len = sprintf(msg, "%ld log records dropped", dropped);
+            add_line(&now, LOG_WARN, msg, len);
+        }
+    }
+    write_batch();
+    pthread_mutex_unlock(&drain_lock);
+    return count;
+}
+
+
+/* Write out every record queued so far */
+void log_flush(void){
+    drain();
+}
+
+
+/* Write records in the background until the process exits */
+static void *run_logger(void *arg){
+    struct timespec idle = {0, LOG_FLUSH_MS * 1000000L};
+    while (1){
+        if (drain() == 0){
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+
+/* Start the thread that writes records to standard output. Records queued
+ * before then are written once it starts, and whatever is left when the
+ * process exits is written by exit.
+ */
+void start_logger(void){
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, run_logger, NULL) != 0){
+        fprintf(stderr, "Could not start the log writer\n");
+        exit(1);
+    }
+    pthread_detach(writer);
+    atexit(log_flush);
+}
@@ -0,0 +1,30 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_WARN 2
+#define LOG_ERROR 3
+
+// Records below LOG_LEVEL are compiled out, arguments and all
+#ifndef LOG_LEVEL
+    #define LOG_LEVEL LOG_INFO
+#endif
+
+#define LOG_RING_SIZE 1024    // Records buffered per thread; a power of two
+#define LOG_MSG_MAX 200       // Longer messages are truncated
+#define LOG_FLUSH_MS 10       // How long the writer sleeps when idle
+
+#define LOG_AT(level, ...) \
+    do { if ((level) >= LOG_LEVEL) log_write((level), __VA_ARGS__); } while (0)
+#define log_debug(...) LOG_AT(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_INFO, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_WARN, __VA_ARGS__)
+#define log_error(...) LOG_AT(LOG_ERROR, __VA_ARGS__)
+
+void log_write(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void start_logger(void);
+void log_flush(void);
+
+#endif
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "metrics.h"
+
+#define MAX_PENDING_TURNS 256
+
+// Add n to a value that only the current thread writes, but that the admin
+// thread may read at any time
+#define BUMP(x, n) __atomic_store_n(&(x), (x) + (n), __ATOMIC_RELAXED)
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+__thread struct metrics *metrics;
+
+/* When each guess of the current tick was read. Its latency is recorded once
+ * the output of the tick has been handed to the sockets. Guesses beyond
+ * MAX_PENDING_TURNS in one tick are not recorded.
+ */
+static __thread uint64_t turn_starts[MAX_PENDING_TURNS];
+static __thread int num_turns = 0;
+
+static const char *latency_names[NUM_LATENCIES] = {
+    "hangman_accept_seconds",
+    "hangman_name_input_seconds",
+    "hangman_turn_seconds",
+    "hangman_dict_pick_seconds",
+};
+
+static const char *counter_names[NUM_COUNTERS] = {
+    "hangman_broadcasts_total",
+    "hangman_broadcast_bytes_total",
+    "hangman_write_calls_total",
+    "hangman_bytes_written_total",
+    "hangman_queued_bytes",
+    "hangman_syscalls_total",
+};
+
+#define NUM_QUANTILES 4
+static const double quantiles[NUM_QUANTILES] = {0.5, 0.9, 0.99, 0.999};
+
+
+/* Return the time in nanoseconds on a clock that never jumps */
+uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* Add n to counter c of the current worker */
+void metrics_add(enum counter c, long n){
+    BUMP(metrics->counters[c], n);
+}
+
+
+/* Return the index of the bucket that holds value */
+static int bucket_of(uint64_t value){
+    if (value < HIST_SUB_BUCKETS){
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    if (shift + 1 >= HIST_LEVELS){
+        return HIST_BUCKETS - 1;
+    }
+    return (shift + 1) * HIST_SUB_BUCKETS + ((value >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+
+/* Return the largest value held by bucket i */
+static uint64_t bucket_top(int i){
+    int level = i / HIST_SUB_BUCKETS;
+    int sub = i % HIST_SUB_BUCKETS;
+    if (level == 0){
+        return sub;
+    }
+    return ((uint64_t) (HIST_SUB_BUCKETS + sub + 1) << (level - 1)) - 1;
+}
+
+
+/* Add value to h */
+void metrics_record(struct histogram *h, uint64_t value){
+    BUMP(h->buckets[bucket_of(value)], 1);
+    BUMP(h->count, 1);
+    BUMP(h->sum, value);
+    if (value > h->max){
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+
+/* Record the time since start, as returned by now_ns, as the latency of l */
+void metrics_latency(enum latency l, uint64_t start){
+    metrics_record(&metrics->latency[l], now_ns() - start);
+}
+
+
+/* Remember that the guess read at start has been broadcast to its room */
+void metrics_turn_queued(uint64_t start){
+    if (num_turns < MAX_PENDING_TURNS){
+        turn_starts[num_turns++] = start;
+    }
+}
+
+
+/* Record the latency of every guess of the tick, now that its output has
+ * been sent.
+ */
+void metrics_turns_sent(void){
+    if (num_turns == 0){
+        return;
+    }
+    uint64_t now = now_ns();
+    for (int i = 0; i < num_turns; i++){
+        metrics_record(&metrics->latency[LAT_TURN], now - turn_starts[i]);
+    }
+    num_turns = 0;
+}
+
+
+/* Add histogram h to total */
+static void sum_histogram(struct histogram *total, const struct histogram *h){
+    for (int i = 0; i < HIST_BUCKETS; i++){
+        total->buckets[i] += LOAD(h->buckets[i]);
+    }
+    total->count += LOAD(h->count);
+    total->sum += LOAD(h->sum);
+    uint64_t max = LOAD(h->max);
+    if (max > total->max){
+        total->max = max;
+    }
+}
+
+
+/* Add the metrics m of a worker to total. m may be written meanwhile, in
+ * which case the result can be off by the few values recorded during the
+ * call.
+ */
+void sum_metrics(struct metrics *total, const struct metrics *m){
+    for (int i = 0; i < NUM_COUNTERS; i++){
+        total->counters[i] += LOAD(m->counters[i]);
+    }
+    for (int i = 0; i < NUM_LATENCIES; i++){
+        sum_histogram(&total->latency[i], &m->latency[i]);
+    }
+    sum_histogram(&total->broadcast_size, &m->broadcast_size);
+}
+
+
+/* Return the smallest bucket top that at least a fraction q of the values
+ * in h are at most.
+ */
+uint64_t histogram_quantile(const struct histogram *h, double q){
+    uint64_t target = (uint64_t) (q * h->count);
+    uint64_t seen = 0;
+    if (target < q * h->count || target == 0){
+        target++;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++){
+        seen += h->buckets[i];
+        if (seen >= target){
+            uint64_t top = bucket_top(i);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+
+/* Print h as a summary called name, dividing every value by scale */
+static void print_histogram(FILE *out, const char *name, const struct histogram *h, double scale){
+    fprintf(out, "# TYPE %s summary\n", name);
+    for (int i = 0; i < NUM_QUANTILES; i++){
+        fprintf(out, "%s{quantile=\"%g\"} %.9g\n", name, quantiles[i],
+            h->count > 0 ? histogram_quantile(h, quantiles[i]) / scale : 0);
+    }
+    fprintf(out, "%s_sum %.9g\n", name, h->sum / scale);
+    fprintf(out, "%s_count %llu\n", name, (unsigned long long) h->count);
+    fprintf(out, "# TYPE %s_max gauge\n", name);
+    fprintf(out, "%s_max %.9g\n", name, h->max / scale);
+}
+
+
+/* Print m in the Prometheus text format */
+void print_metrics(FILE *out, const struct metrics *m){
+    for (int i = 0; i < NUM_COUNTERS; i++){
+        fprintf(out, "# TYPE %s %s\n", counter_names[i],
+            i == CTR_QUEUED_BYTES ? "gauge" : "counter");
+        fprintf(out, "%s %ld\n", counter_names[i], m->counters[i]);
+    }
+    for (int i = 0; i < NUM_LATENCIES; i++){
+        print_histogram(out, latency_names[i], &m->latency[i], 1e9);
+    }
+    print_histogram(out, "hangman_broadcast_bytes", &m->broadcast_size, 1);
+}
@@ -0,0 +1,66 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_LEVELS 37        // Values up to 2^40, about 18 minutes in ns
+#define HIST_BUCKETS (HIST_LEVELS * HIST_SUB_BUCKETS)
+
+/* Operations whose latency is recorded, in nanoseconds */
+enum latency {
+    LAT_ACCEPT,               // Accepting and setting up one connection
+    LAT_NAME,                 // Handling one line of name input
+    LAT_TURN,                 // From reading a guess to its broadcasts being sent
+    LAT_DICT_PICK,            // Picking a word for a new game
+    NUM_LATENCIES
+};
+
+/* Counters, and gauges that go up and down */
+enum counter {
+    CTR_BROADCASTS,           // Messages sent to a whole room
+    CTR_BROADCAST_BYTES,      // Bytes queued by broadcasts, over all recipients
+    CTR_WRITE_CALLS,          // write, writev and io_uring sends to clients
+    CTR_BYTES_WRITTEN,        // Bytes taken by those calls
+    CTR_QUEUED_BYTES,         // Bytes waiting for slow clients (gauge)
+    CTR_SYSCALLS,             // System calls made by the event loops
+    NUM_COUNTERS
+};
+
+/* A histogram with buckets that grow exponentially, each split into
+ * HIST_SUB_BUCKETS linear sub-buckets, so every value is kept to within
+ * about 6% without knowing its range in advance. Recording is a few
+ * shifts and an increment.
+ */
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+/* The metrics of one worker thread. Only that worker writes them, so
+ * recording needs no locked instructions; the admin thread only reads them.
+ */
+struct metrics {
+    long counters[NUM_COUNTERS];
+    struct histogram latency[NUM_LATENCIES];
+    struct histogram broadcast_size;    // Bytes queued by one broadcast
+};
+
+// The metrics of the worker running on the current thread
+extern __thread struct metrics *metrics;
+
+uint64_t now_ns(void);
+void metrics_add(enum counter c, long n);
+void metrics_record(struct histogram *h, uint64_t value);
+void metrics_latency(enum latency l, uint64_t start);
+void metrics_turn_queued(uint64_t start);
+void metrics_turns_sent(void);
+uint64_t histogram_quantile(const struct histogram *h, double q);
+void sum_metrics(struct metrics *total, const struct metrics *m);
+void print_metrics(FILE *out, const struct metrics *m);
+
+#endif
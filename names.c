@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "names.h"
+#include "game.h"
+
+/* Every name in use on the server, kept once however many messages it is
+ * written into. A name is identified by an id that stays valid until it
+ * is released, and its string never moves, so clients can keep a pointer
+ * to it.
+ *
+ * The registry is split into NAME_SHARDS shards by hash, each with its own
+ * lock, so that workers naming clients at the same time rarely wait for
+ * each other. Each shard is a chained hash table whose chains link ids
+ * rather than pointers, and whose names are allocated NAME_CHUNK at a time
+ * and reused once released. The id of a name is its index in its shard
+ * times NAME_SHARDS plus the shard, so that the shard of an id is known
+ * without hashing.
+ *
+ * A thread can have a registry of its own instead, so that the names it
+ * accepts do not depend on what other threads are doing at the time.
+ */
+
+struct name_entry {
+    uint32_t hash;
+    unsigned next;            // Next id in the same bucket, or free list
+    char str[MAX_NAME];
+};
+
+struct name_shard {
+    pthread_mutex_t lock;
+    unsigned *buckets;        // The first id in each bucket, or NO_NAME
+    unsigned mask;            // Number of buckets minus one
+    unsigned count;           // Names in the table, read by names_in_use
+    unsigned allocated;       // Entries handed out so far, including index 0
+    unsigned free;            // Released ids, linked through next
+    struct name_entry *chunks[NAME_CHUNKS];
+} __attribute__((aligned(64)));
+
+struct name_registry {
+    struct name_shard shards[NAME_SHARDS];
+};
+
+static struct name_registry shared;
+static pthread_once_t names_once = PTHREAD_ONCE_INIT;
+static __thread struct name_registry *own = NULL;   // See use_private_names
+
+#define MIN_BUCKETS 64
+
+
+/* Hash the string s with 32-bit FNV-1a */
+uint32_t hash_name(const char *s){
+    uint32_t h = 2166136261u;
+    for (; *s != '\0'; s++){
+        h ^= (unsigned char) *s;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+/* Return the entry of id, which belongs to shard s */
+static struct name_entry *entry(struct name_shard *s, unsigned id){
+    unsigned index = id / NAME_SHARDS;
+    return &s->chunks[index / NAME_CHUNK][index % NAME_CHUNK];
+}
+
+
+/* Return the bucket of s for hash. The low bits picked the shard. */
+static unsigned *bucket(struct name_shard *s, uint32_t hash){
+    return &s->buckets[(hash / NAME_SHARDS) & s->mask];
+}
+
+
+/* Set up the empty shards of r */
+static void init_registry(struct name_registry *r){
+    for (int i = 0; i < NAME_SHARDS; i++){
+        struct name_shard *s = &r->shards[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->buckets = calloc(MIN_BUCKETS, sizeof(unsigned));
+        if (!s->buckets){
+            perror("calloc");
+            exit(1);
+        }
+        s->mask = MIN_BUCKETS - 1;
+        // Index 0 is never used, so that no id is NO_NAME
+        s->allocated = 1;
+    }
+}
+
+
+/* Set up the shared registry, on first use */
+static void init_names(void){
+    init_registry(&shared);
+}
+
+
+/* Return the shards of the registry the current thread uses */
+static struct name_shard *shards(void){
+    if (own != NULL){
+        return own->shards;
+    }
+    pthread_once(&names_once, init_names);
+    return shared.shards;
+}
+
+
+/* Give the current thread an empty registry of its own, which it uses
+ * instead of the shared one from now on. A replay does this, since which
+ * worker took a name first is down to timing.
+ */
+void use_private_names(void){
+    own = calloc(1, sizeof(struct name_registry));
+    if (!own){
+        perror("calloc");
+        exit(1);
+    }
+    init_registry(own);
+}
+
+
+/* Double the number of buckets of s, to keep chains short */
+static void grow_buckets(struct name_shard *s){
+    unsigned size = (s->mask + 1) * 2;
+    unsigned *old = s->buckets;
+    unsigned old_size = s->mask + 1;
+    s->buckets = calloc(size, sizeof(unsigned));
+    if (!s->buckets){
+        perror("calloc");
+        exit(1);
+    }
+    s->mask = size - 1;
+    for (unsigned i = 0; i < old_size; i++){
+        unsigned id = old[i];
+        while (id != NO_NAME){
+            struct name_entry *e = entry(s, id);
+            unsigned next = e->next;
+            unsigned *b = bucket(s, e->hash);
+            e->next = *b;
+            *b = id;
+            id = next;
+        }
+    }
+    free(old);
+}
+
+
+/* Return an unused id of shard number n, or NO_NAME if it is full */
+static unsigned new_id(struct name_shard *s, unsigned n){
+    if (s->free != NO_NAME){
+        unsigned id = s->free;
+        s->free = entry(s, id)->next;
+        return id;
+    }
+    unsigned index = s->allocated;
+    if (index / NAME_CHUNK == NAME_CHUNKS){
+        return NO_NAME;
+    }
+    if (s->chunks[index / NAME_CHUNK] == NULL){
+        s->chunks[index / NAME_CHUNK] = malloc(NAME_CHUNK * sizeof(struct name_entry));
+        if (!s->chunks[index / NAME_CHUNK]){
+            perror("malloc");
+            exit(1);
+        }
+    }
+    s->allocated++;
+    return index * NAME_SHARDS + n;
+}
+
+
+/* Register name, which is shorter than MAX_NAME, as in use.
+ * Return its id, or NO_NAME if it is already in use.
+ */
+unsigned register_name(const char *name){
+    uint32_t hash = hash_name(name);
+    unsigned n = hash & (NAME_SHARDS - 1);
+    struct name_shard *s = &shards()[n];
+
+    pthread_mutex_lock(&s->lock);
+    unsigned *b = bucket(s, hash);
+    for (unsigned id = *b; id != NO_NAME; id = entry(s, id)->next){
+        struct name_entry *e = entry(s, id);
+        if (e->hash == hash && strcmp(e->str, name) == 0){
+            pthread_mutex_unlock(&s->lock);
+            return NO_NAME;
+        }
+    }
+
+    unsigned id = new_id(s, n);
+    if (id != NO_NAME){
+        struct name_entry *e = entry(s, id);
+        e->hash = hash;
+        strcpy(e->str, name);
+        e->next = *b;
+        *b = id;
+        __atomic_store_n(&s->count, s->count + 1, __ATOMIC_RELAXED);
+        if (s->count > s->mask + 1){
+            grow_buckets(s);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return id;
+}
+
+
+/* Make the name with the given id available again. Does nothing for
+ * NO_NAME.
+ */
+void release_name(unsigned id){
+    if (id == NO_NAME){
+        return;
+    }
+    struct name_shard *s = &shards()[id & (NAME_SHARDS - 1)];
+    pthread_mutex_lock(&s->lock);
+    struct name_entry *e = entry(s, id);
+    unsigned *link = bucket(s, e->hash);
+    while (*link != id){
+        link = &entry(s, *link)->next;
+    }
+    *link = e->next;
+    e->next = s->free;
+    s->free = id;
+    __atomic_store_n(&s->count, s->count - 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&s->lock);
+}
+
+
+/* Return the string of the name with the given id, or "" for NO_NAME.
+ * It stays valid until the id is released.
+ */
+const char *name_str(unsigned id){
+    if (id == NO_NAME){
+        return "";
+    }
+    return entry(&shards()[id & (NAME_SHARDS - 1)], id)->str;
+}
+
+
+/* Return the number of names in use in the registry of the current thread */
+long names_in_use(void){
+    struct name_shard *s = shards();
+    long total = 0;
+    for (int i = 0; i < NAME_SHARDS; i++){
+        total += __atomic_load_n(&s[i].count, __ATOMIC_RELAXED);
+    }
+    return total;
+}
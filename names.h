@@ -0,0 +1,18 @@
+#ifndef _NAMES_H_
+#define _NAMES_H_
+
+#include <stdint.h>
+
+#define NO_NAME 0             // The id of a client that has no name yet
+#define NAME_SHARDS 64        // Independently locked parts; a power of two
+#define NAME_CHUNK 4096       // Names allocated at a time in each shard
+#define NAME_CHUNKS 4096      // Most chunks in a shard: 16M names per shard
+
+uint32_t hash_name(const char *s);
+unsigned register_name(const char *name);
+void release_name(unsigned id);
+const char *name_str(unsigned id);
+long names_in_use(void);
+void use_private_names(void);
+
+#endif
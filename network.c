@@ -1,12 +1,18 @@
+#define _GNU_SOURCE        /* accept4 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 #include <arpa/inet.h>     /* inet_ntoa */
 #include <netdb.h>         /* gethostname */
 #include <sys/socket.h>
+#include <sys/un.h>
 
 #include "network.h"
+#include "log.h"
 
 /*
  * Initialize a server address associated with the given port.
@@ -32,8 +38,10 @@ struct sockaddr_in *init_server(int port) {
 
 /*
  * Create and set up a socket for a server to listen on.
+ * If reuse_port is non-zero, SO_REUSEPORT is set so that several sockets,
+ * one per worker thread, can listen on the same port.
  */
-int set_up_socket(struct sockaddr_in *self, int num_queue) {
+int set_up_socket(struct sockaddr_in *self, int num_queue, int reuse_port) {
     int soc = socket(PF_INET, SOCK_STREAM, 0);
     if (soc < 0) {
         perror("socket");
@@ -50,6 +58,14 @@ int set_up_socket(struct sockaddr_in *self, int num_queue) {
         exit(1);
     }
 
+    // Let the kernel spread incoming connections across every socket
+    // bound to this port.
+    if (reuse_port && setsockopt(soc, SOL_SOCKET, SO_REUSEPORT,
+        (const char *) &on, sizeof(on)) < 0) {
+        perror("setsockopt");
+        exit(1);
+    }
+
     // Associate the process with the address and a port
     if (bind(soc, (struct sockaddr *)self, sizeof(*self)) < 0) {
         // bind failed; could be because port is in use.
@@ -69,26 +85,248 @@ int set_up_socket(struct sockaddr_in *self, int num_queue) {
 
 
 /*
- * Wait for and accept a new connection.
- * Terminate with exit code 1 if the accept call failed, otherwise return
- * the client's socket descriptor.
+ * Create a Unix domain socket that listens at path, replacing any socket
+ * left there by a previous run.
  */
-int accept_connection(int listenfd) {
-    struct sockaddr_in peer;
-    unsigned int peer_len = sizeof(peer);
-    peer.sin_family = PF_INET;
-
-    printf("Waiting for a new connection...\n");
-    int client_socket = accept(listenfd, (struct sockaddr *)&peer, &peer_len);
-    if (client_socket < 0) {
-        perror("accept");
+int set_up_local_socket(const char *path, int num_queue) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int soc = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (soc < 0) {
+        perror("socket");
         exit(1);
-    } else {
-        printf("New connection accepted from %s:%d\n",
-            inet_ntoa(peer.sin_addr),
-            ntohs(peer.sin_port));
-        return client_socket;
     }
+    unlink(path);
+    if (bind(soc, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    if (listen(soc, num_queue) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    return soc;
+}
+
+
+
+/*
+ * Connect to the Unix socket at path.
+ * Return the connected socket, or -1 if nobody is listening there.
+ */
+int connect_local_socket(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int soc = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (soc < 0) {
+        return -1;
+    }
+    if (connect(soc, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(soc);
+        return -1;
+    }
+    return soc;
+}
+
+
+/*
+ * Send the count descriptors in fds, at most MAX_FDS_PER_MSG of them, over
+ * the Unix socket soc, along with a single byte.
+ * Return 0 on success and -1 on failure.
+ */
+int send_fds(int soc, const int *fds, int count) {
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(MAX_FDS_PER_MSG * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+
+    while (sendmsg(soc, &msg, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
 }
 
 
+/*
+ * Receive exactly count descriptors sent by send_fds over soc into fds.
+ * Return 0 on success and -1 on failure, in which case any descriptors
+ * that did arrive are closed.
+ */
+int recv_fds(int soc, int *fds, int count) {
+    char byte;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(MAX_FDS_PER_MSG * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int n;
+    while ((n = recvmsg(soc, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (n == 1 && !(msg.msg_flags & MSG_CTRUNC) && cmsg != NULL
+            && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+            && cmsg->cmsg_len == CMSG_LEN(count * sizeof(int))
+            && CMSG_NXTHDR(&msg, cmsg) == NULL) {
+        memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+        return 0;
+    }
+
+    // Close whatever was received, since nobody will use it
+    for (; n >= 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < received; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            close(fd);
+        }
+    }
+    return -1;
+}
+
+/*
+ * Put fd into non-blocking mode.
+ * Return 0 on success and -1 if fcntl failed.
+ */
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Accept a pending connection on the non-blocking socket listenfd and
+ * store the client's address in peer. The new socket is non-blocking and
+ * closed on exec.
+ * Return the client's socket descriptor, -1 if there are no more pending
+ * connections, or -2 if the process has run out of file descriptors or
+ * memory for it.
+ */
+int accept_connection(int listenfd, struct sockaddr_in *peer) {
+    while (1) {
+        socklen_t peer_len = sizeof(*peer);
+        int client_socket = accept4(listenfd, (struct sockaddr *)peer, &peer_len,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket >= 0) {
+            log_debug("New connection accepted from %s:%d",
+                inet_ntoa(peer->sin_addr),
+                ntohs(peer->sin_port));
+            return client_socket;
+        }
+        if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+            return -2;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return -1;
+        }
+        // The connection failed before it could be accepted (for
+        // instance ECONNABORTED), so move on to the next one
+        log_debug("accept: %s", strerror(errno));
+    }
+}
+
+
+/*
+ * Open a file descriptor that is held in reserve, to be closed when the
+ * process runs out of descriptors so that a connection can still be
+ * accepted and turned away. See shed_connections.
+ * Return the descriptor, or -1 on failure, with errno set.
+ */
+int reserve_fd(void) {
+    return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+
+/*
+ * Accept and close every pending connection on listenfd after the process
+ * ran out of file descriptors, using the descriptor *reserve, which is
+ * reopened afterwards. Each client is sent msg first, if it can take it,
+ * and counted in *count. Otherwise, with a level of pending connections
+ * that never drops, the event loop would be woken up for them again and
+ * again.
+ * Another thread can take the descriptor given up before accept gets it,
+ * or before it is reopened; *reserve is then -1 and is reopened first on
+ * the next call.
+ * Return 0 once no connection is pending, or -1 if some may be left, in
+ * which case the caller should call again later: the listener will not
+ * report them again until another connection arrives.
+ */
+int shed_connections(int listenfd, int *reserve, const char *msg, int *count) {
+    while (1) {
+        if (*reserve < 0 && (*reserve = reserve_fd()) < 0) {
+            return -1;
+        }
+        close(*reserve);
+        int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        int accept_errno = errno;
+        if (fd >= 0) {
+            // Best effort: the client is closed whether or not it gets msg
+            write(fd, msg, strlen(msg));
+            close(fd);
+            (*count)++;
+        }
+        *reserve = reserve_fd();
+        if (fd < 0 && accept_errno != ECONNABORTED) {
+            return accept_errno == EAGAIN || accept_errno == EWOULDBLOCK ? 0 : -1;
+        }
+    }
+}
+
+
+/*
+ * Wait before calling accept again on a blocking listening socket that a
+ * thread of its own serves, after accept failed with errno. Errors such as
+ * running out of file descriptors come back at once until something else
+ * changes, so retrying straight away would spin. *failures counts failures
+ * in a row, and only the first is reported; the caller sets it back to 0
+ * once accept succeeds.
+ */
+void accept_backoff(const char *what, int *failures) {
+    int accept_errno = errno;
+    if (accept_errno == EINTR || accept_errno == ECONNABORTED) {
+        return;
+    }
+    if ((*failures)++ == 0) {
+        log_warn("accept on the %s socket: %s; retrying every %d ms", what,
+            strerror(accept_errno), ACCEPT_BACKOFF_MS);
+    }
+    struct timespec pause = {0, ACCEPT_BACKOFF_MS * 1000000L};
+    nanosleep(&pause, NULL);
+}
@@ -3,8 +3,19 @@
 
 #include <netinet/in.h>    /* Internet domain header, for struct sockaddr_in */
 
+#define MAX_FDS_PER_MSG 250   // The kernel accepts up to 253 per message
+#define ACCEPT_BACKOFF_MS 100 // Pause after a failed accept, see accept_backoff
+
 struct sockaddr_in *init_server(int port);
-int set_up_socket(struct sockaddr_in *self, int num_queue);
-int accept_connection(int listenfd);
+int set_up_socket(struct sockaddr_in *self, int num_queue, int reuse_port);
+int set_up_local_socket(const char *path, int num_queue);
+int connect_local_socket(const char *path);
+int send_fds(int soc, const int *fds, int count);
+int recv_fds(int soc, int *fds, int count);
+int set_nonblocking(int fd);
+int accept_connection(int listenfd, struct sockaddr_in *peer);
+int reserve_fd(void);
+int shed_connections(int listenfd, int *reserve, const char *msg, int *count);
+void accept_backoff(const char *what, int *failures);
 
 #endif
@@ -0,0 +1,98 @@
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include "proto.h"
+
+/* Each function below writes one frame to buf, which must have room for
+ * MAX_FRAME bytes unless noted otherwise, and returns its length.
+ */
+
+
+/* Write the header of a frame with opcode op and len bytes of payload, and
+ * return the length of the frame.
+ */
+static int header(char *buf, enum opcode op, int len){
+    uint16_t n = htons(len + 1);
+    memcpy(buf, &n, sizeof(n));
+    buf[2] = op;
+    return FRAME_HEADER + len;
+}
+
+
+/* Append the 32-bit value to buf in network byte order */
+static char *put_u32(char *buf, uint32_t value){
+    value = htonl(value);
+    memcpy(buf, &value, sizeof(value));
+    return buf + sizeof(value);
+}
+
+
+/* Write the len bytes of text in a frame. buf must have room for
+ * FRAME_HEADER + len bytes.
+ */
+int frame_text(char *buf, const char *text, int len){
+    memcpy(buf + FRAME_HEADER, text, len);
+    return header(buf, OP_TEXT, len);
+}
+
+
+/* Write a frame whose payload is a player's name */
+int frame_name(char *buf, enum opcode op, const char *name){
+    int len = strlen(name);
+    memcpy(buf + FRAME_HEADER, name, len);
+    return header(buf, op, len);
+}
+
+
+/* Write the answer to PROTO_REQUEST */
+int frame_hello(char *buf){
+    buf[FRAME_HEADER] = PROTO_VERSION;
+    return header(buf, OP_HELLO, 1);
+}
+
+
+/* Write the whole state of game, for a player who needs all of it */
+int frame_state(char *buf, enum opcode op, struct game_state *game){
+    char *p = buf + FRAME_HEADER;
+    *p++ = game->guesses_left;
+    p = put_u32(p, game->guessed);
+    render_guess(p, game);
+    return header(buf, op, 5 + game->word_len);
+}
+
+
+/* Write who has the turn, to the player called name if yours is 1 */
+int frame_turn(char *buf, int yours, const char *name){
+    int len = strlen(name);
+    buf[FRAME_HEADER] = yours;
+    memcpy(buf + FRAME_HEADER + 1, name, len);
+    return header(buf, OP_TURN, 1 + len);
+}
+
+
+/* Write the outcome of guessing letter: bit i of positions is set if
+ * letter is at position i of the word, and guesses_left remain.
+ */
+int frame_guess(char *buf, char letter, uint32_t positions, int guesses_left){
+    char *p = buf + FRAME_HEADER;
+    *p++ = letter;
+    p = put_u32(p, positions);
+    *p = guesses_left;
+    return header(buf, OP_GUESS, 6);
+}
+
+
+/* Write the end of the game of word, won by the player called winner, or
+ * by nobody if winner is "". won is 1 for the winner's own frame.
+ */
+int frame_game_over(char *buf, int won, const char *word, const char *winner){
+    int word_len = strlen(word);
+    int len = strlen(winner);
+    char *p = buf + FRAME_HEADER;
+    *p++ = won;
+    *p++ = word_len;
+    memcpy(p, word, word_len);
+    memcpy(p + word_len, winner, len);
+    return header(buf, OP_GAME_OVER, 2 + word_len + len);
+}
@@ -0,0 +1,40 @@
+#ifndef _PROTO_H_
+#define _PROTO_H_
+
+#include "game.h"
+
+/* The binary protocol. A client switches to it by sending PROTO_REQUEST as
+ * its first line, before its name; it keeps sending lines as before. From
+ * then on, the server sends it frames instead of text. A frame is a 2 byte
+ * length in network byte order, counting the opcode and payload, followed
+ * by a 1 byte opcode and its payload. Rather than the whole status of the
+ * game, a frame describes what changed.
+ */
+#define PROTO_REQUEST "PROTOCOL BINARY"
+#define PROTO_VERSION 1
+#define FRAME_HEADER 3
+#define MAX_FRAME (FRAME_HEADER + 2 * MAX_NAME + MAX_WORD + 8)
+
+enum opcode {
+    OP_HELLO = 1,     // u8 version: the switch to the binary protocol is done
+    OP_TEXT,          // The text message, for anything without its own opcode
+    OP_STATE,         // u8 guesses left, u32 guessed letters, the word as shown
+    OP_NEW_GAME,      // Same as OP_STATE, for a game that has just started
+    OP_JOIN,          // The name of a player who entered the game
+    OP_LEAVE,         // The name of a player who left the game
+    OP_TURN,          // u8 1 if it is the recipient's turn, the name of the player
+    OP_TIMEOUT,       // The name of a player who ran out of time
+    OP_GUESS,         // u8 letter, u32 positions revealed, u8 guesses left
+    OP_GAME_OVER      // u8 1 if the recipient won, u8 length of the word, the
+                      // word, then the name of the winner, if anyone won
+};
+
+int frame_text(char *buf, const char *text, int len);
+int frame_name(char *buf, enum opcode op, const char *name);
+int frame_hello(char *buf);
+int frame_state(char *buf, enum opcode op, struct game_state *game);
+int frame_turn(char *buf, int yours, const char *name);
+int frame_guess(char *buf, char letter, uint32_t positions, int guesses_left);
+int frame_game_over(char *buf, int won, const char *word, const char *winner);
+
+#endif
@@ -0,0 +1,457 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "queue.h"
+#include "metrics.h"
+
+#define ARENA_BLOCK 65536
+#define IOV_BATCH 64
+
+int max_backlog = DEFAULT_MAX_BACKLOG;
+int max_stall = DEFAULT_MAX_STALL;
+
+
+/* A block of the arena that holds the messages and struct pending written
+ * during one tick. Blocks are kept and reused by the following ticks.
+ */
+struct arena_block {
+    struct arena_block *next;
+    int used;
+    int cap;
+    char data[];
+};
+
+// The arena of the worker running on the current thread
+static __thread struct arena_block *arena_head = NULL;
+static __thread struct arena_block *arena_cur = NULL;
+
+/* A reference to a message held by the current tick, in the arena */
+struct held {
+    struct message *msg;
+    struct held *next;
+};
+
+// The messages written during the current tick
+static __thread struct held *held = NULL;
+
+
+/* Return the current time in seconds on a clock that never jumps */
+static time_t now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+
+/* Return count bytes of memory that stay valid until end_tick is called */
+void *tick_alloc(int count){
+    count = (count + 7) & ~7;
+    while (arena_cur != NULL && arena_cur->used + count > arena_cur->cap){
+        // A block that is too small for a large message is skipped over
+        if (arena_cur->next == NULL || arena_cur->next->cap < count){
+            break;
+        }
+        arena_cur = arena_cur->next;
+    }
+    if (arena_cur == NULL || arena_cur->used + count > arena_cur->cap){
+        int cap = count > ARENA_BLOCK ? count : ARENA_BLOCK;
+        struct arena_block *b = malloc(sizeof(struct arena_block) + cap);
+        if (!b){
+            perror("malloc");
+            exit(1);
+        }
+        b->used = 0;
+        b->cap = cap;
+        if (arena_cur == NULL){
+            b->next = NULL;
+            arena_head = b;
+        } else {
+            b->next = arena_cur->next;
+            arena_cur->next = b;
+        }
+        arena_cur = b;
+    }
+    void *p = arena_cur->data + arena_cur->used;
+    arena_cur->used += count;
+    return p;
+}
+
+
+/* Copy count bytes from buf into the arena of the current tick, and return
+ * the copy. It can be passed to queue_defer for any number of clients.
+ */
+const char *tick_copy(const char *buf, int count){
+    char *copy = tick_alloc(count);
+    memcpy(copy, buf, count);
+    return copy;
+}
+
+
+/* Release the arena once every client has been sent its output */
+void end_tick(void){
+    for (struct held *h = held; h != NULL; h = h->next){
+        release_message(h->msg);
+    }
+    held = NULL;
+    for (struct arena_block *b = arena_head; b != NULL; b = b->next){
+        b->used = 0;
+    }
+    arena_cur = arena_head;
+}
+
+
+/* Return an empty message with room for cap bytes, held by the caller */
+struct message *new_message(int cap){
+    struct message *m = malloc(sizeof(struct message) + cap);
+    if (!m){
+        perror("malloc");
+        exit(1);
+    }
+    m->refs = 1;
+    m->len = 0;
+    m->cap = cap;
+    return m;
+}
+
+
+/* Return m, held by the caller, in a state where it can be changed: m
+ * itself if nobody else holds it, or else a copy that replaces the caller's
+ * reference, so that what was already written stays as it was.
+ */
+struct message *edit_message(struct message *m){
+    if (m->refs == 1){
+        return m;
+    }
+    struct message *copy = new_message(m->cap);
+    memcpy(copy->data, m->data, m->len);
+    copy->len = m->len;
+    release_message(m);
+    return copy;
+}
+
+
+/* Drop a reference to m, and free it once nobody holds it */
+void release_message(struct message *m){
+    if (--m->refs == 0){
+        free(m);
+    }
+}
+
+
+/* Hold m until the end of the tick and return its bytes, which can be
+ * passed to queue_defer for any number of clients without being copied.
+ */
+const char *tick_share(struct message *m){
+    struct held *h = tick_alloc(sizeof(struct held));
+    m->refs++;
+    h->msg = m;
+    h->next = held;
+    held = h;
+    return m->data;
+}
+
+
+/* Initialize an empty queue */
+void init_queue(struct out_queue *q){
+    q->data = NULL;
+    q->start = 0;
+    q->len = 0;
+    q->cap = 0;
+    q->stalled_since = 0;
+    q->first = NULL;
+    q->last = NULL;
+    q->pending_len = 0;
+    q->sending = NULL;
+    q->send_start = 0;
+    q->send_len = 0;
+}
+
+
+/* Append count bytes from buf to the end of q.
+ * Return 0 on success and -1 if q would exceed max_backlog.
+ */
+static int queue_append(struct out_queue *q, const char *buf, int count){
+    if (q->len + q->send_len + count > max_backlog){
+        return -1;
+    }
+    // Move the unsent bytes to the front, and grow if that is not enough
+    if (q->start + q->len + count > q->cap){
+        if (q->start > 0){
+            memmove(q->data, q->data + q->start, q->len);
+            q->start = 0;
+        }
+        if (q->len + count > q->cap){
+            int cap = q->cap > 0 ? q->cap : 1024;
+            while (cap < q->len + count){
+                cap *= 2;
+            }
+            char *data = realloc(q->data, cap);
+            if (!data){
+                perror("realloc");
+                return -1;
+            }
+            q->data = data;
+            q->cap = cap;
+        }
+    }
+    memcpy(q->data + q->start + q->len, buf, count);
+    q->len += count;
+    metrics_add(CTR_QUEUED_BYTES, count);
+    return 0;
+}
+
+
+/* Add count bytes at buf, which was returned by tick_copy, to the messages
+ * sent to q's client at the end of this tick.
+ * Return 0 on success, or -1 if the client is too slow to keep up, in which
+ * case it should be disconnected.
+ */
+int queue_defer(struct out_queue *q, const char *buf, int count){
+    if (q->len + q->send_len + q->pending_len + count > max_backlog){
+        return -1;
+    }
+
+    struct pending *p = tick_alloc(sizeof(struct pending));
+    p->buf = buf;
+    p->len = count;
+    p->next = NULL;
+    if (q->last != NULL){
+        q->last->next = p;
+    } else {
+        q->first = p;
+    }
+    q->last = p;
+    q->pending_len += count;
+    return 0;
+}
+
+
+/* Send the queued bytes followed by the messages of this tick to fd, using
+ * as few writev calls as the socket allows. Whatever the socket cannot take
+ * is copied to the queue, since the messages only live until the end of
+ * the tick.
+ * Return 0 on success, or -1 if the socket failed or the client is too slow
+ * to keep up.
+ */
+int queue_send(struct out_queue *q, int fd){
+    struct iovec iov[IOV_BATCH];
+    int was_empty = q->len == 0;
+    int progress = 0;
+
+    while (q->len > 0 || q->first != NULL){
+        int n = 0;
+        int offered = 0;
+        if (q->len > 0){
+            iov[n].iov_base = q->data + q->start;
+            iov[n++].iov_len = q->len;
+            offered += q->len;
+        }
+        for (struct pending *p = q->first; p != NULL && n < IOV_BATCH; p = p->next){
+            iov[n].iov_base = (void *) p->buf;
+            iov[n++].iov_len = p->len;
+            offered += p->len;
+        }
+
+        int num_write = writev(fd, iov, n);
+        metrics_add(CTR_WRITE_CALLS, 1);
+        metrics_add(CTR_SYSCALLS, 1);
+        if (num_write == -1){
+            if (errno != EAGAIN && errno != EWOULDBLOCK){
+                q->first = q->last = NULL;
+                q->pending_len = 0;
+                return -1;
+            }
+            break;
+        }
+        int written = num_write;
+        if (written > 0){
+            progress = 1;
+            metrics_add(CTR_BYTES_WRITTEN, written);
+        }
+
+        // Consume what was written, from the queue first
+        int from_queue = num_write < q->len ? num_write : q->len;
+        q->start += from_queue;
+        q->len -= from_queue;
+        metrics_add(CTR_QUEUED_BYTES, -from_queue);
+        num_write -= from_queue;
+        while (num_write > 0){
+            struct pending *p = q->first;
+            int taken = num_write < p->len ? num_write : p->len;
+            p->buf += taken;
+            p->len -= taken;
+            q->pending_len -= taken;
+            num_write -= taken;
+            if (p->len == 0){
+                q->first = p->next;
+            }
+        }
+        if (q->first == NULL){
+            q->last = NULL;
+        }
+
+        // Stop once the socket did not take everything it was offered
+        if (written < offered){
+            break;
+        }
+    }
+
+    // Keep what could not be sent for when the socket becomes writable
+    int status = 0;
+    for (struct pending *p = q->first; p != NULL && status == 0; p = p->next){
+        status = queue_append(q, p->buf, p->len);
+    }
+    q->first = q->last = NULL;
+    q->pending_len = 0;
+
+    if (q->len == 0){
+        free_queue(q);
+    } else if (was_empty || progress){
+        q->stalled_since = now();
+    }
+    return status;
+}
+
+
+/* Return the number of seconds the output queued in q has been waiting
+ * without the socket taking any of it, or -1 if nothing is queued.
+ */
+int queue_stalled(const struct out_queue *q){
+    if (q->len + q->send_len == 0){
+        return -1;
+    }
+    return now() - q->stalled_since;
+}
+
+
+/* Write as much of the queued bytes to fd as the socket will take.
+ * Return 0 on success, or -1 if the socket failed.
+ */
+int queue_flush(struct out_queue *q, int fd){
+    while (q->len > 0){
+        int num_write = write(fd, q->data + q->start, q->len);
+        metrics_add(CTR_WRITE_CALLS, 1);
+        metrics_add(CTR_SYSCALLS, 1);
+        if (num_write == -1){
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                return 0;
+            }
+            return -1;
+        }
+        q->start += num_write;
+        q->len -= num_write;
+        metrics_add(CTR_BYTES_WRITTEN, num_write);
+        metrics_add(CTR_QUEUED_BYTES, -num_write);
+        q->stalled_since = now();
+    }
+    // Give the memory back once the client has caught up
+    free(q->data);
+    q->data = NULL;
+    q->start = 0;
+    q->cap = 0;
+    return 0;
+}
+
+
+/* Move the messages of this tick to the queue, so that they outlive the
+ * tick. This is how the io_uring backend sends output: from the queue, once
+ * the tick is over.
+ * Return 0 on success, or -1 if the client is too slow to keep up.
+ */
+int queue_collect(struct out_queue *q){
+    int was_empty = q->len + q->send_len == 0;
+    int status = 0;
+    for (struct pending *p = q->first; p != NULL && status == 0; p = p->next){
+        status = queue_append(q, p->buf, p->len);
+    }
+    q->first = q->last = NULL;
+    q->pending_len = 0;
+    if (was_empty){
+        q->stalled_since = now();
+    }
+    return status;
+}
+
+
+/* Drop the messages of this tick as if they had been sent, for a client
+ * that has no socket.
+ * Return the number of bytes dropped.
+ */
+int queue_discard(struct out_queue *q){
+    int count = q->pending_len;
+    q->first = q->last = NULL;
+    q->pending_len = 0;
+    return count;
+}
+
+
+/* If no output is being sent, hand all of the queue over to be sent, in
+ * q->sending. It is not moved or freed until the send completes, while
+ * later output is queued behind it.
+ * Return 1 if there is now output to send, 0 otherwise.
+ */
+int queue_start_send(struct out_queue *q){
+    if (q->sending != NULL || q->len == 0){
+        return 0;
+    }
+    q->sending = q->data;
+    q->send_start = q->start;
+    q->send_len = q->len;
+    q->data = NULL;
+    q->start = 0;
+    q->len = 0;
+    q->cap = 0;
+    return 1;
+}
+
+
+/* Record that count bytes of the output being sent were sent.
+ * Return 1 if there is output left to send, as per queue_start_send.
+ */
+int queue_sent(struct out_queue *q, int count){
+    q->send_start += count;
+    q->send_len -= count;
+    q->stalled_since = now();
+    metrics_add(CTR_BYTES_WRITTEN, count);
+    metrics_add(CTR_QUEUED_BYTES, -count);
+    if (q->send_len > 0){
+        return 1;
+    }
+    free(q->sending);
+    q->sending = NULL;
+    return queue_start_send(q);
+}
+
+
+/* Free the output being sent, once the kernel no longer uses it */
+void queue_abort_send(struct out_queue *q){
+    metrics_add(CTR_QUEUED_BYTES, -q->send_len);
+    free(q->sending);
+    q->sending = NULL;
+    q->send_start = 0;
+    q->send_len = 0;
+}
+
+
+/* Free the memory used by q and empty it. Messages of this tick are
+ * dropped; their memory belongs to the arena. Output being sent is left for
+ * queue_abort_send, since the kernel may still be using it.
+ */
+void free_queue(struct out_queue *q){
+    if (q->len > 0){
+        metrics_add(CTR_QUEUED_BYTES, -q->len);
+    }
+    free(q->data);
+    q->data = NULL;
+    q->start = 0;
+    q->len = 0;
+    q->cap = 0;
+    q->stalled_since = 0;
+    q->first = NULL;
+    q->last = NULL;
+    q->pending_len = 0;
+}
@@ -0,0 +1,78 @@
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+#include <time.h>
+
+#define DEFAULT_MAX_BACKLOG 65536
+#define DEFAULT_MAX_STALL 30
+
+/* A message written to a client during the current tick of the event loop.
+ * The bytes live in the tick's arena (see tick_copy), so a message that is
+ * broadcast is stored once and shared by every recipient.
+ */
+struct pending {
+    const char *buf;
+    int len;
+    struct pending *next;
+};
+
+/* A message kept across ticks, such as the status of a room, which is
+ * rendered once and shared by every client it is written to. Its owner and
+ * each tick it is written during hold a reference, and it is only changed
+ * while its owner holds the only one (see edit_message).
+ */
+struct message {
+    int refs;
+    int len;
+    int cap;
+    char data[];
+};
+
+/* Output waiting to be written to a client's socket.
+ * Messages written during a tick are only gathered in first..last, and are
+ * sent together with a single writev at the end of the tick. Whatever the
+ * socket cannot take without blocking is then copied to data and written
+ * when the socket becomes writable again, so that one slow reader never
+ * blocks the event loop.
+ * With io_uring, the queue is handed to the kernel to send instead, and
+ * is kept in sending until the send completes.
+ */
+struct out_queue {
+    char *data;               // NULL while nothing is queued
+    int start;                // Index in data of the first unsent byte
+    int len;                  // Number of unsent bytes
+    int cap;
+    time_t stalled_since;     // When the queue last stopped making progress
+    struct pending *first;    // Messages written during this tick
+    struct pending *last;
+    int pending_len;          // Number of bytes in first..last
+    char *sending;            // Being sent by io_uring, or NULL
+    int send_start;           // Index in sending of the first unsent byte
+    int send_len;             // Number of unsent bytes in sending
+};
+
+// A client is disconnected once it has more than max_backlog bytes queued,
+// or its queue has made no progress for max_stall seconds.
+extern int max_backlog;
+extern int max_stall;
+
+void init_queue(struct out_queue *q);
+void *tick_alloc(int count);
+const char *tick_copy(const char *buf, int count);
+int queue_defer(struct out_queue *q, const char *buf, int count);
+int queue_send(struct out_queue *q, int fd);
+int queue_flush(struct out_queue *q, int fd);
+int queue_stalled(const struct out_queue *q);
+int queue_collect(struct out_queue *q);
+int queue_discard(struct out_queue *q);
+int queue_start_send(struct out_queue *q);
+int queue_sent(struct out_queue *q, int count);
+void queue_abort_send(struct out_queue *q);
+void free_queue(struct out_queue *q);
+void end_tick(void);
+struct message *new_message(int cap);
+struct message *edit_message(struct message *m);
+void release_message(struct message *m);
+const char *tick_share(struct message *m);
+
+#endif
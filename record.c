@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "record.h"
+#include "log.h"
+
+// 1 while events are being recorded, or replayed
+int recording = 0;
+int replaying = 0;
+
+// The file events are appended to
+static int record_fd = -1;
+static const char *record_path;
+
+/* The events of the worker running on the current thread that have yet to
+ * be written. They are written whole, so that the events of one worker are
+ * never split by those of another.
+ */
+static __thread char *buf = NULL;
+static __thread int buf_len = 0;
+static __thread int worker_index = 0;
+static __thread int batch_events = 0;   // Events since the last REC_BATCH
+
+
+/* Create the file at path and record the events of num_workers workers
+ * to it from now on.
+ */
+void start_recording(const char *path, int num_workers){
+    record_path = path;
+    record_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    struct record_header header = {RECORD_MAGIC, RECORD_VERSION, num_workers};
+    if (record_fd == -1 || write(record_fd, &header, sizeof(header)) != sizeof(header)){
+        perror(path);
+        exit(1);
+    }
+    recording = 1;
+}
+
+
+/* Write out the events buffered by the current worker */
+static void flush_events(void){
+    const char *p = buf;
+    while (recording && buf_len > 0){
+        ssize_t n = write(record_fd, p, buf_len);
+        if (n < 0 && errno != EINTR){
+            log_error("Could not write to %s: %s; events are no longer recorded",
+                record_path, strerror(errno));
+            recording = 0;
+        } else if (n > 0){
+            p += n;
+            buf_len -= n;
+        }
+    }
+    buf_len = 0;
+}
+
+
+/* Record that the current thread is worker number worker, and picks its
+ * words with seed.
+ */
+void record_worker(int worker, unsigned seed){
+    if (!recording){
+        return;
+    }
+    buf = malloc(RECORD_BUF);
+    if (!buf){
+        perror("malloc");
+        exit(1);
+    }
+    worker_index = worker;
+    record_event(REC_SEED, seed, NULL, 0);
+}
+
+
+/* Record an event of the current worker, with the len bytes at data */
+void record_event(enum record_type type, unsigned id, const char *data, int len){
+    if (!recording){
+        return;
+    }
+    struct record rec = {type, worker_index, len, id};
+    if (buf_len + sizeof(rec) + len > RECORD_BUF){
+        flush_events();
+    }
+    memcpy(buf + buf_len, &rec, sizeof(rec));
+    if (len > 0){
+        memcpy(buf + buf_len + sizeof(rec), data, len);
+    }
+    buf_len += sizeof(rec) + len;
+    batch_events++;
+}
+
+
+/* Record the end of a batch of events of the current worker, if it had
+ * any, and write out its events
+ */
+void record_batch(void){
+    if (!recording || batch_events == 0){
+        return;
+    }
+    record_event(REC_BATCH, 0, NULL, 0);
+    batch_events = 0;
+    flush_events();
+}
+
+
+/* Map the recording at path into log.
+ * Return 0 on success and -1 if it cannot be read.
+ */
+int open_replay(const char *path, struct replay_log *log){
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1){
+        perror(path);
+        if (fd != -1){
+            close(fd);
+        }
+        return -1;
+    }
+    struct record_header header;
+    if (st.st_size < (off_t) sizeof(header)
+            || read(fd, &header, sizeof(header)) != sizeof(header)
+            || header.magic != RECORD_MAGIC || header.version != RECORD_VERSION){
+        fprintf(stderr, "%s is not a recording this build can replay\n", path);
+        close(fd);
+        return -1;
+    }
+    log->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (log->data == MAP_FAILED){
+        perror("mmap");
+        return -1;
+    }
+    madvise((void *) log->data, st.st_size, MADV_SEQUENTIAL);
+    log->len = st.st_size;
+    log->num_workers = header.num_workers;
+    return 0;
+}
+
+
+/* Copy the next event of worker in log from *pos on to rec, move *pos
+ * past it and return its bytes. Return NULL once there are none left. An
+ * event cut short at the end of the file is left out.
+ */
+const char *next_record(const struct replay_log *log, size_t *pos, int worker,
+        struct record *rec){
+    if (*pos == 0){
+        *pos = sizeof(struct record_header);
+    }
+    while (*pos + sizeof(struct record) <= log->len){
+        // Events are packed, so they are copied out rather than cast
+        memcpy(rec, log->data + *pos, sizeof(struct record));
+        const char *data = log->data + *pos + sizeof(struct record);
+        if (*pos + sizeof(struct record) + rec->len > log->len){
+            return NULL;
+        }
+        *pos += sizeof(struct record) + rec->len;
+        if (rec->worker == worker){
+            return data;
+        }
+    }
+    return NULL;
+}
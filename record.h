@@ -0,0 +1,63 @@
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RECORD_MAGIC 0x48524543   // "HREC"
+#define RECORD_VERSION 2
+#define RECORD_BUF 65536          // Events buffered per worker between writes
+
+/* A recording of everything that reached the workers from outside: each
+ * connection, the bytes it sent, when it went away, turns that ran out of
+ * time, and the seed each worker picks words with. Fed to the same
+ * handlers, it makes every worker go through the same games again.
+ *
+ * The file starts with a struct record_header, followed by events. Each
+ * event is a struct record followed by len bytes, in host byte order, since
+ * it is replayed on the same kind of machine. Events of different workers
+ * are interleaved, but those of one worker are in the order they happened.
+ */
+enum record_type {
+    REC_SEED = 1,             // id is the seed of the worker
+    REC_CONNECT,              // id is the new connection
+    REC_INPUT,                // Bytes received from connection id
+    REC_CLOSE,                // Connection id was disconnected
+    REC_TURN_TIMEOUT,         // The turn timer of room id expired
+    REC_BATCH,                // The worker finished a batch of events
+    REC_RESTORE_CLIENT,       // A client was taken over, see record_restored
+    REC_RESTORE_ROOM          // A room and its players were taken over
+};
+
+struct record_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_workers;
+};
+
+struct record {
+    uint8_t type;
+    uint8_t worker;
+    uint16_t len;
+    uint32_t id;
+};
+
+/* A recording mapped into memory to be replayed */
+struct replay_log {
+    const char *data;
+    size_t len;
+    int num_workers;
+};
+
+extern int recording;
+extern int replaying;
+
+void start_recording(const char *path, int num_workers);
+void record_worker(int worker, unsigned seed);
+void record_event(enum record_type type, unsigned id, const char *data, int len);
+void record_batch(void);
+int open_replay(const char *path, struct replay_log *log);
+const char *next_record(const struct replay_log *log, size_t *pos, int worker,
+    struct record *rec);
+
+#endif
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+
+/* Create a ring for the current thread and add it to set. It is aligned
+ * to a cache line, as malloc does not guarantee, so that head, tail and the
+ * records each start one.
+ */
+static struct ring *new_ring(struct ring_set *set){
+    size_t size = sizeof(struct ring) + (size_t) set->size * set->record_size;
+    struct ring *r;
+    int err = posix_memalign((void **) &r, CACHE_LINE, size);
+    if (err != 0){
+        fprintf(stderr, "posix_memalign: %s\n", strerror(err));
+        exit(1);
+    }
+    memset(r, 0, size);
+    r->mask = set->size - 1;
+    r->record_size = set->record_size;
+    r->next = __atomic_load_n(&set->rings, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&set->rings, &r->next, r, 0,
+            __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)){
+    }
+    return r;
+}
+
+
+/* Return the next free record of *mine, the ring of the current thread in
+ * set, creating it if needed. The record is handed to the consumer by
+ * ring_publish once it is filled in. Return NULL, and count the record as
+ * dropped, if the ring is full.
+ */
+void *ring_reserve(struct ring_set *set, struct ring **mine){
+    if (*mine == NULL){
+        *mine = new_ring(set);
+    }
+    struct ring *r = *mine;
+    if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->mask + 1){
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    return ring_record(r, r->head);
+}
+
+
+/* Hand the record returned by ring_reserve over to the consumer */
+void ring_publish(struct ring *r){
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Return the most recently created ring of set; the others follow
+ * through next.
+ */
+struct ring *first_ring(struct ring_set *set){
+    return __atomic_load_n(&set->rings, __ATOMIC_ACQUIRE);
+}
+
+
+/* Return the index after the last record published in r. The consumer
+ * can read every record from r->tail up to it.
+ */
+unsigned long ring_head(struct ring *r){
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+
+/* Return the record of r at index */
+void *ring_record(struct ring *r, unsigned long index){
+    return r->records + (size_t) (index & r->mask) * r->record_size;
+}
+
+
+/* Give every record of r before tail back to its owner */
+void ring_consume(struct ring *r, unsigned long tail){
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+}
+
+
+/* Return the number of records dropped from r since the last call */
+long ring_take_dropped(struct ring *r){
+    return __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,43 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#define CACHE_LINE 64
+
+/* Per-thread rings of fixed-size records, filled by the thread that owns
+ * the ring and emptied by a single consumer thread. The owner is the only
+ * one to move head and the consumer the only one to move tail, so neither
+ * needs a lock: each publishes its index with a release store that the
+ * other reads with an acquire load. When a ring is full, records are
+ * dropped and counted rather than making the owner wait.
+ *
+ * A thread's ring is created by its first record and added to a ring_set,
+ * which the consumer walks. Rings are only ever added to a set.
+ */
+struct ring {
+    unsigned long head __attribute__((aligned(CACHE_LINE)));  // Next record to fill
+    long dropped;
+    unsigned long tail __attribute__((aligned(CACHE_LINE)));  // Next record to consume
+    struct ring *next;
+    unsigned mask;            // Number of records - 1
+    unsigned record_size;
+    char records[] __attribute__((aligned(CACHE_LINE)));
+};
+
+struct ring_set {
+    struct ring *rings;
+    unsigned size;            // Records per ring; a power of two
+    unsigned record_size;
+};
+
+// A ring_set of rings of count records of the given type
+#define RING_SET(count, type) {NULL, (count), sizeof(type)}
+
+void *ring_reserve(struct ring_set *set, struct ring **mine);
+void ring_publish(struct ring *r);
+struct ring *first_ring(struct ring_set *set);
+unsigned long ring_head(struct ring *r);
+void *ring_record(struct ring *r, unsigned long index);
+void ring_consume(struct ring *r, unsigned long tail);
+long ring_take_dropped(struct ring *r);
+
+#endif
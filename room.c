@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "room.h"
+#include "engine.h"
+#include "log.h"
+
+
+/* Add game to the front of the list of rooms with space */
+static void link_open(struct room_manager *rooms, struct game_state *game){
+    game->prev_open = NULL;
+    game->next_open = rooms->open;
+    if (rooms->open != NULL){
+        rooms->open->prev_open = game;
+    }
+    rooms->open = game;
+}
+
+
+/* Remove game from the list of rooms with space */
+static void unlink_open(struct room_manager *rooms, struct game_state *game){
+    if (game->prev_open != NULL){
+        game->prev_open->next_open = game->next_open;
+    } else {
+        rooms->open = game->next_open;
+    }
+    if (game->next_open != NULL){
+        game->next_open->prev_open = game->prev_open;
+    }
+    game->prev_open = NULL;
+    game->next_open = NULL;
+}
+
+
+/* Make game the room with the given id in the index of rooms, growing it
+ * as needed
+ */
+static void set_room(struct room_manager *rooms, int id, struct game_state *game){
+    if (id >= rooms->index_size){
+        int old = rooms->index_size;
+        rooms->index_size = id * 2 + 64;
+        rooms->by_id = realloc(rooms->by_id, rooms->index_size * sizeof(struct game_state *));
+        if (!rooms->by_id){
+            perror("realloc");
+            exit(1);
+        }
+        memset(rooms->by_id + old, 0, (rooms->index_size - old) * sizeof(struct game_state *));
+    }
+    rooms->by_id[id] = game;
+}
+
+
+/* Initialize an empty set of rooms of room_size players */
+void init_rooms(struct room_manager *rooms, int room_size){
+    rooms->room_size = room_size;
+    rooms->num_rooms = 0;
+    rooms->next_id = 0;
+    rooms->all = NULL;
+    rooms->open = NULL;
+    rooms->retired = NULL;
+    rooms->by_id = NULL;
+    rooms->index_size = 0;
+}
+
+
+/* Keep rooms indexed by id from now on, for find_room. The index grows
+ * with every room ever created, so only a replay uses it.
+ */
+void index_rooms(struct room_manager *rooms){
+    for (struct game_state *game = rooms->all; game != NULL; game = game->next_room){
+        set_room(rooms, game->id, game);
+    }
+    if (rooms->by_id == NULL){
+        set_room(rooms, 0, NULL);
+    }
+}
+
+
+/* Return the room with the given id if it has not been retired, or NULL.
+ * The rooms must be indexed.
+ */
+struct game_state *find_room(struct room_manager *rooms, int id){
+    return id >= 0 && id < rooms->index_size ? rooms->by_id[id] : NULL;
+}
+
+
+/* Create an empty room with a new game, and add it to the rooms with
+ * space.
+ */
+struct game_state *new_room(struct room_manager *rooms){
+    struct game_state *game = malloc(sizeof(struct game_state));
+    if (!game) {
+        perror("malloc");
+        exit(1);
+    }
+    game->dict = NULL;
+    game->band = default_band;
+    game->num_recent = 0;
+    game->status = NULL;
+    game->id = rooms->next_id++;
+    game->num_players = 0;
+    game->head = NULL;
+    game->has_next_turn = NULL;
+    game->next_retired = NULL;
+    init_timer(&game->turn_timer, turn_expired);
+    init_game(game);
+
+    game->prev_room = NULL;
+    game->next_room = rooms->all;
+    if (rooms->all != NULL){
+        rooms->all->prev_room = game;
+    }
+    rooms->all = game;
+    link_open(rooms, game);
+    if (rooms->by_id != NULL){
+        set_room(rooms, game->id, game);
+    }
+    rooms->num_rooms++;
+    log_debug("[room %d] Created, %d rooms open", game->id, rooms->num_rooms);
+    return game;
+}
+
+
+/* Return a room that has space for another player, creating a new room
+ * if every existing room is full.
+ */
+struct game_state *open_room(struct room_manager *rooms){
+    if (rooms->open != NULL){
+        return rooms->open;
+    }
+    return new_room(rooms);
+}
+
+
+/* Add player to the head of game, which was returned by open_room */
+void join_room(struct room_manager *rooms, struct game_state *game, struct client *player){
+    player->game = game;
+    link_client(&game->head, player);
+
+    game->num_players++;
+    if (game->num_players == rooms->room_size){
+        unlink_open(rooms, game);
+    }
+}
+
+
+/* Account for a player that has been removed from game->head.
+ * A room that becomes empty is retired and freed by free_retired_rooms,
+ * since the caller may still be using it.
+ */
+void leave_room(struct room_manager *rooms, struct game_state *game){
+    game->num_players--;
+    if (game->num_players == 0){
+        if (rooms->room_size > 1){
+            unlink_open(rooms, game);
+        }
+        if (game->prev_room != NULL){
+            game->prev_room->next_room = game->next_room;
+        } else {
+            rooms->all = game->next_room;
+        }
+        if (game->next_room != NULL){
+            game->next_room->prev_room = game->prev_room;
+        }
+        if (rooms->by_id != NULL){
+            rooms->by_id[game->id] = NULL;
+        }
+        game->next_retired = rooms->retired;
+        rooms->retired = game;
+    } else if (game->num_players == rooms->room_size - 1){
+        link_open(rooms, game);
+    }
+}
+
+
+/* Free every room retired by leave_room */
+void free_retired_rooms(struct room_manager *rooms){
+    while (rooms->retired != NULL){
+        struct game_state *t = rooms->retired->next_retired;
+        log_debug("[room %d] Retired, %d rooms open", rooms->retired->id, rooms->num_rooms - 1);
+        release_dictionary(rooms->retired->dict);
+        release_message(rooms->retired->status);
+        cancel_timer(&rooms->retired->turn_timer);
+        free(rooms->retired);
+        rooms->num_rooms--;
+        rooms->retired = t;
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef _ROOM_H_
+#define _ROOM_H_
+
+#include "game.h"
+
+#ifndef ROOM_SIZE
+    #define ROOM_SIZE 8
+#endif
+
+/* Creates, fills and retires the rooms hosted by the server. Each room is a
+ * separate game_state with its own word, players and turn order.
+ */
+struct room_manager {
+    int room_size;              // Maximum number of players in a room
+    int num_rooms;
+    int next_id;
+    struct game_state *all;     // Every room that has not been retired
+    struct game_state *open;    // Rooms with fewer than room_size players
+    struct game_state *retired; // Rooms emptied during the current batch
+    struct game_state **by_id;  // Each room by id if indexed, or NULL
+    int index_size;
+};
+
+void init_rooms(struct room_manager *rooms, int room_size);
+void index_rooms(struct room_manager *rooms);
+struct game_state *find_room(struct room_manager *rooms, int id);
+struct game_state *new_room(struct room_manager *rooms);
+struct game_state *open_room(struct room_manager *rooms);
+void join_room(struct room_manager *rooms, struct game_state *game, struct client *player);
+void leave_room(struct room_manager *rooms, struct game_state *game);
+void free_retired_rooms(struct room_manager *rooms);
+
+#endif
@@ -0,0 +1,394 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "scores.h"
+#include "names.h"
+#include "log.h"
+#include "ring.h"
+
+#define MIN_TABLE 1024
+
+/* The results recorded by each worker, waiting for the writer, so that
+ * recording a result never takes a lock or waits for the disk. When a ring
+ * is full, results are dropped and counted.
+ */
+static struct ring_set rings = RING_SET(SCORES_RING_SIZE, struct score_record);
+static __thread struct ring *ring = NULL;
+
+// Held while committing, so that scores_flush can run alongside the writer
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct score_record batch[SCORES_BATCH];
+
+// The log results are appended to, or -1 if they are only kept in memory
+static int log_fd = -1;
+static const char *log_path;
+static off_t log_loaded;         // Bytes of the log in the totals
+
+/* The totals of every player, in an open-addressed table keyed by name,
+ * and the TOP_PLAYERS players with the most wins, best first. Both only
+ * change once the results they include are on disk. Wins never go down, so
+ * the leaders can be kept up to date one result at a time.
+ */
+struct totals {
+    struct score *table;
+    unsigned mask;            // Number of slots - 1
+    unsigned count;           // Number of players in table
+    struct score top[TOP_PLAYERS];
+    int num_top;
+};
+
+/* Two copies of the totals, so that a worker answering stats or top never
+ * waits for the writer. Workers read copies[readable]. The writer adds each
+ * batch to the other copy, makes it the one to read, waits for the workers
+ * still reading the old copy to leave it, and adds the batch to that one
+ * as well. readers[i] counts the workers reading copies[i]; the table is
+ * kept twice, which is the price of never blocking them.
+ */
+static struct totals copies[2];
+static int readable = 0;
+static struct {
+    long count __attribute__((aligned(CACHE_LINE)));
+} readers[2];
+
+
+/* Queue the result of a game for player name: won or lost, after guessing
+ * guesses letters. It is saved and counted by the writer thread shortly.
+ */
+void record_result(const char *name, int won, int lost, int guesses){
+    struct score_record *rec = ring_reserve(&rings, &ring);
+    if (rec == NULL){
+        return;
+    }
+    strncpy(rec->name, name, MAX_NAME);
+    rec->won = won;
+    rec->lost = lost;
+    rec->guesses = guesses > UINT16_MAX ? UINT16_MAX : guesses;
+    ring_publish(ring);
+}
+
+
+/* Return the slot of the player called name in the table of t, or the
+ * empty slot where it belongs.
+ */
+static struct score *find_slot(struct totals *t, const char *name){
+    unsigned i = hash_name(name) & t->mask;
+    while (t->table[i].name[0] != '\0' && strcmp(t->table[i].name, name) != 0){
+        i = (i + 1) & t->mask;
+    }
+    return &t->table[i];
+}
+
+
+/* Give t an empty table of size slots */
+static void new_table(struct totals *t, unsigned size){
+    t->table = calloc(size, sizeof(struct score));
+    if (!t->table){
+        perror("calloc");
+        exit(1);
+    }
+    t->mask = size - 1;
+}
+
+
+/* Double the size of the table of t, to keep probes short */
+static void grow_table(struct totals *t){
+    struct score *old = t->table;
+    unsigned old_size = t->mask + 1;
+    new_table(t, old_size * 2);
+    for (unsigned i = 0; i < old_size; i++){
+        if (old[i].name[0] != '\0'){
+            *find_slot(t, old[i].name) = old[i];
+        }
+    }
+    free(old);
+}
+
+
+/* Move s, whose wins have just gone up, into the leaders of t if it
+ * belongs
+ */
+static void update_top(struct totals *t, const struct score *s){
+    int i = 0;
+    while (i < t->num_top && strcmp(t->top[i].name, s->name) != 0){
+        i++;
+    }
+    if (i == t->num_top){
+        if (t->num_top < TOP_PLAYERS){
+            t->num_top++;
+        } else if (s->wins <= t->top[t->num_top - 1].wins){
+            return;
+        }
+        i = t->num_top - 1;
+    }
+    t->top[i] = *s;
+    while (i > 0 && t->top[i - 1].wins < t->top[i].wins){
+        struct score swap = t->top[i - 1];
+        t->top[i - 1] = t->top[i];
+        t->top[i] = swap;
+        i--;
+    }
+}
+
+
+/* Add rec to t, which no worker is reading */
+static void apply(struct totals *t, const struct score_record *rec){
+    char name[MAX_NAME];
+    memcpy(name, rec->name, MAX_NAME);
+    name[MAX_NAME - 1] = '\0';
+    if (name[0] == '\0'){
+        return;
+    }
+    if ((t->count + 1) * 4 > (t->mask + 1) * 3){
+        grow_table(t);
+    }
+    struct score *s = find_slot(t, name);
+    if (s->name[0] == '\0'){
+        strcpy(s->name, name);
+        t->count++;
+    }
+    s->wins += rec->won;
+    s->losses += rec->lost;
+    s->guesses += rec->guesses;
+    if (rec->won || (t->num_top > 0 && s->wins >= t->top[t->num_top - 1].wins)){
+        update_top(t, s);
+    }
+}
+
+
+/* Add the count results at recs to both copies of the totals. Only one
+ * thread at a time calls this, holding commit_lock once the writer runs.
+ */
+static void publish(const struct score_record *recs, long count){
+    int spare = !readable;
+    for (long i = 0; i < count; i++){
+        apply(&copies[spare], &recs[i]);
+    }
+    __atomic_store_n(&readable, spare, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&readers[!spare].count, __ATOMIC_SEQ_CST) > 0){
+        sched_yield();
+    }
+    for (long i = 0; i < count; i++){
+        apply(&copies[!spare], &recs[i]);
+    }
+}
+
+
+/* Return the copy of the totals to read, which stays as it is until
+ * stop_reading is called with it.
+ */
+static int start_reading(void){
+    while (1){
+        int i = __atomic_load_n(&readable, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&readers[i].count, 1, __ATOMIC_SEQ_CST);
+        // Unless the writer switched copies in between, it will wait for us
+        if (__atomic_load_n(&readable, __ATOMIC_SEQ_CST) == i){
+            return i;
+        }
+        __atomic_fetch_sub(&readers[i].count, 1, __ATOMIC_RELEASE);
+    }
+}
+
+
+/* Let the writer change copies[i] again */
+static void stop_reading(int i){
+    __atomic_fetch_sub(&readers[i].count, 1, __ATOMIC_RELEASE);
+}
+
+
+/* Stop saving results after a failed operation on the log */
+static void log_failed(const char *op){
+    log_error("Could not %s %s: %s; results are no longer saved", op, log_path,
+        strerror(errno));
+    close(log_fd);
+    log_fd = -1;
+}
+
+
+/* Append count results to the log and wait until they are on disk */
+static void commit(const struct score_record *recs, int count){
+    const char *buf = (const char *) recs;
+    size_t left = count * sizeof(struct score_record);
+    while (log_fd != -1 && left > 0){
+        ssize_t n = write(log_fd, buf, left);
+        if (n < 0 && errno != EINTR){
+            log_failed("write to");
+        } else if (n > 0){
+            buf += n;
+            left -= n;
+        }
+    }
+    if (log_fd != -1 && fdatasync(log_fd) == -1){
+        log_failed("sync");
+    }
+}
+
+
+/* Commit every result queued by the workers so far, up to SCORES_BATCH of
+ * them, with a single write and fsync, then add them to the totals.
+ * Return the number of results committed.
+ */
+static int drain(void){
+    int count = 0;
+    pthread_mutex_lock(&commit_lock);
+    for (struct ring *r = first_ring(&rings); r != NULL && count < SCORES_BATCH; r = r->next){
+        unsigned long tail = r->tail;
+        unsigned long head = ring_head(r);
+        for (; tail != head && count < SCORES_BATCH; tail++){
+            batch[count++] = *(struct score_record *) ring_record(r, tail);
+        }
+        ring_consume(r, tail);
+
+        long dropped = ring_take_dropped(r);
+        if (dropped > 0){
+            log_warn("%ld game results dropped", dropped);
+        }
+    }
+    if (count > 0){
+        commit(batch, count);
+        publish(batch, count);
+    }
+    pthread_mutex_unlock(&commit_lock);
+    return count;
+}
+
+
+/* Commit every result recorded so far */
+void scores_flush(void){
+    while (drain() > 0){
+    }
+}
+
+
+/* Commit results in the background until the process exits */
+static void *run_scores(void *arg){
+    struct timespec idle = {0, SCORES_FLUSH_MS * 1000000L};
+    while (1){
+        if (drain() == 0){
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+
+/* Open the log at path, creating it if needed, and rebuild the totals from
+ * every result in it. A result cut short by a crash is discarded.
+ */
+static void load_log(const char *path){
+    log_path = path;
+    log_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat st;
+    if (log_fd == -1 || fstat(log_fd, &st) == -1){
+        perror(path);
+        exit(1);
+    }
+    off_t size = st.st_size - st.st_size % sizeof(struct score_record);
+    if (size != st.st_size){
+        log_warn("Discarding a partial result at the end of %s", path);
+        if (ftruncate(log_fd, size) == -1){
+            perror("ftruncate");
+            exit(1);
+        }
+    }
+
+    long count = size / sizeof(struct score_record);
+    if (count > 0){
+        const struct score_record *recs = mmap(NULL, size, PROT_READ, MAP_PRIVATE, log_fd, 0);
+        if (recs == MAP_FAILED){
+            perror("mmap");
+            exit(1);
+        }
+        madvise((void *) recs, size, MADV_SEQUENTIAL);
+        publish(recs, count);
+        munmap((void *) recs, size);
+    }
+    log_loaded = size;
+    log_info("Loaded %ld results for %u players from %s", count,
+        copies[readable].count, path);
+}
+
+
+/* Add the results appended to the log since it was loaded by another
+ * process: the server this one took over from, which keeps saving results
+ * until it stops.
+ */
+void scores_catch_up(void){
+    long count = 0;
+    pthread_mutex_lock(&commit_lock);
+    while (log_fd != -1){
+        ssize_t n = pread(log_fd, batch, sizeof(batch), log_loaded);
+        int read = n > 0 ? n / sizeof(struct score_record) : 0;
+        if (read == 0){
+            break;
+        }
+        publish(batch, read);
+        log_loaded += read * sizeof(struct score_record);
+        count += read;
+    }
+    pthread_mutex_unlock(&commit_lock);
+    if (count > 0){
+        log_info("Loaded %ld more results from %s", count, log_path);
+    }
+}
+
+
+/* Load player statistics from the log at path, where they are also saved
+ * once start_scores is called. If path is NULL, they are only kept in
+ * memory.
+ */
+void load_scores(const char *path){
+    new_table(&copies[0], MIN_TABLE);
+    new_table(&copies[1], MIN_TABLE);
+    if (path != NULL){
+        load_log(path);
+    }
+}
+
+
+/* Start the thread that saves and counts results */
+void start_scores(void){
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, run_scores, NULL) != 0){
+        fprintf(stderr, "Could not start the statistics writer\n");
+        exit(1);
+    }
+    pthread_detach(writer);
+    atexit(scores_flush);
+}
+
+
+/* Copy the totals of the player called name to out.
+ * Return 1 if they have any, or 0 if they have no results yet.
+ */
+int lookup_score(const char *name, struct score *out){
+    int found = 0;
+    int i = start_reading();
+    struct score *s = find_slot(&copies[i], name);
+    if (s->name[0] != '\0'){
+        *out = *s;
+        found = 1;
+    }
+    stop_reading(i);
+    return found;
+}
+
+
+/* Copy the players with the most wins, best first, to out, which has room
+ * for TOP_PLAYERS. Return the number copied.
+ */
+int top_scores(struct score *out){
+    int i = start_reading();
+    int count = copies[i].num_top;
+    memcpy(out, copies[i].top, count * sizeof(struct score));
+    stop_reading(i);
+    return count;
+}
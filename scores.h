@@ -0,0 +1,39 @@
+#ifndef _SCORES_H_
+#define _SCORES_H_
+
+#include <stdint.h>
+
+#include "game.h"
+
+#define SCORES_RING_SIZE 4096   // Results buffered per worker; a power of two
+#define SCORES_BATCH 8192       // Most results committed with one fsync
+#define SCORES_FLUSH_MS 5       // How long the writer sleeps when idle
+#define TOP_PLAYERS 10
+
+/* One result as it is appended to the log: the outcome of a game for one
+ * player, or the guesses of a player who left before the game ended.
+ */
+struct score_record {
+    char name[MAX_NAME];
+    uint8_t won;
+    uint8_t lost;
+    uint16_t guesses;
+};
+
+/* The totals of one player over every result recorded so far */
+struct score {
+    char name[MAX_NAME];
+    unsigned wins;
+    unsigned losses;
+    unsigned guesses;
+};
+
+void load_scores(const char *path);
+void start_scores(void);
+void scores_flush(void);
+void scores_catch_up(void);
+void record_result(const char *name, int won, int lost, int guesses);
+int lookup_score(const char *name, struct score *out);
+int top_scores(struct score *out);
+
+#endif
@@ -6,132 +6,358 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <stddef.h>
 #include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <poll.h>
 
 #include "network.h"
 #include "game.h"
+#include "room.h"
+#include "engine.h"
+#include "timer.h"
+#include "metrics.h"
+#include "log.h"
+#include "uring.h"
+#include "scores.h"
+#include "snapshot.h"
+#include "proto.h"
+#include "record.h"
 #include <signal.h>
 
 #ifndef PORT
     #define PORT 54261
 #endif
-#define MAX_QUEUE 5
+#define DEFAULT_LISTEN_BACKLOG SOMAXCONN
+#define ADMIN_QUEUE 5
+#define MAX_EVENTS 256
+#define MAX_THREADS 256
+#define CLIENT_SLAB 256
+#define DEFAULT_NAME_TIMEOUT 60
+#define DEFAULT_IDLE_TIMEOUT 600
+#define BUSY_MSG "The server is full. Try again later\r\n"
+#define UPGRADE_ACK_TIMEOUT 5000
+#define UPGRADE_COMMIT 'C'    // The old server exits, and the new one takes over
+#define UPGRADE_ABORT 'A'     // The old server carries on, and the new one exits
 
 
-/* The set of socket descriptors for select to monitor.
+/* Clients that take longer than name_timeout seconds to enter a name, or
+ * that send nothing for idle_timeout seconds while playing, are
+ * disconnected. A timeout of 0 disables it.
+ */
+int name_timeout = DEFAULT_NAME_TIMEOUT;
+int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+
+/* The number of connections the kernel queues on each listening socket
+ * before the workers accept them. Connections beyond it are refused or
+ * have their SYNs dropped, so it has to absorb bursts of reconnects.
+ */
+int listen_backlog = DEFAULT_LISTEN_BACKLOG;
+
+
+/* Counters kept by each worker thread. They are only written by their own
+ * worker and are read by the main thread when it prints statistics.
+ */
+struct worker_stats {
+    long accepted;    // Connections accepted
+    long clients;     // Clients currently connected
+    long rooms;       // Rooms currently open
+    long guesses;     // Valid guesses processed
+    long games;       // Games finished
+    long shed;        // Connections turned away for lack of file descriptors
+};
+
+/* A worker thread runs its own event loop on its own SO_REUSEPORT listener
+ * and owns every client and room it accepts, so workers share no mutable
+ * game state.
+ */
+struct worker {
+    int id;
+    unsigned seed;        // Seeds the words the worker picks
+    pthread_t thread;
+    int listenfd;
+    struct worker_stats stats;
+    struct metrics metrics;
+};
+
+/* What the upgrade thread needs to hand the server over */
+struct upgrade {
+    int listenfd;
+    struct worker *workers;
+    int num_workers;
+};
+
+/* What the admin thread needs to answer requests on its socket */
+struct admin {
+    int listenfd;
+    struct worker *workers;
+    int num_workers;
+};
+
+/* The state below belongs to the worker running on the current thread.
+ *
+ * The epoll instance that monitors the listening socket and every client.
  * This is a global variable because we need to remove socket descriptors
- * from allset when a write to a socket fails.
+ * from it when a write to a socket fails.
+ */
+__thread int epfd;
+
+/* Clients that have been disconnected during the current batch of events.
+ * They are freed only once the whole batch has been handled, since a later
+ * event in the same batch may still carry a pointer to them.
+ */
+__thread struct client *dead_clients = NULL;
+
+/* A list of client who have not yet entered their name.  This list is
+ * kept separate from the list of active players in the game, because
+ * until the new playrs have entered a name, they should not have a turn
+ * or receive broadcast messages.  In other words, they can't play until
+ * they have a name, and only then are they routed to a room.
+ */
+__thread struct client *new_players = NULL;
+
+/* Clients that can be reused by add_player, linked through next */
+__thread struct client *free_clients = NULL;
+
+/* The events of the game being handled, see engine.h */
+__thread struct game_events events;
+
+/* The number of the next connection of the worker */
+__thread unsigned next_conn = 0;
+
+/* Every room hosted by the worker */
+__thread struct room_manager rooms;
+
+/* Statistics of the worker */
+__thread struct worker_stats *stats;
+
+/* A file descriptor kept open so that it can be given up to turn away
+ * connections when the process runs out of them.
+ */
+__thread int spare_fd = -1;
+
+/* Turns away the connections left on shed_listenfd when shed could not get
+ * through all of them
+ */
+__thread struct timer shed_timer;
+__thread int shed_listenfd = -1;
+
+
+/* Add n to a counter in struct worker_stats. Only the worker writes its
+ * counters, so a plain add is enough; the relaxed store keeps the main
+ * thread from reading a torn value.
+ */
+void stat_add(long *counter, long n){
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+
+/* Return an unused client. Clients are allocated CLIENT_SLAB at a time and
+ * are never given back to the system, so that connecting and disconnecting
+ * does not call malloc and free.
  */
-fd_set allset;
+struct client *alloc_client() {
+    if (free_clients == NULL) {
+        struct client *slab = malloc(sizeof(struct client) * CLIENT_SLAB);
+        if (!slab) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int i = 0; i < CLIENT_SLAB; i++) {
+            slab[i].next = free_clients;
+            free_clients = &slab[i];
+        }
+    }
+    struct client *p = free_clients;
+    free_clients = p->next;
+    return p;
+}
 
 
-/* Fill buf with count null terminators */
-void null_terminate_all(char *buf, int count){
-    for (int i = 0; i < count; i++){
-        buf[i] = '\0';
+/* Stop monitoring and close the socket of client p, and queue p to be freed
+ * once the current batch of events has been handled.
+ */
+void discard_client(struct client *p) {
+    log_debug("Removing client %d %s", p->fd, inet_ntoa(p->ipaddr));
+    record_event(REC_CLOSE, p->conn, NULL, 0);
+    if (replaying) {
+        // There is no socket to close
+    } else if (use_io_uring) {
+        // Make the pending receive and send complete; until they do, they
+        // keep the socket open and p in use
+        shutdown(p->fd, SHUT_RDWR);
+        close(p->fd);
+        metrics_add(CTR_SYSCALLS, 2);
+    } else {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+        close(p->fd);
+        metrics_add(CTR_SYSCALLS, 2);
     }
+    p->fd = -1;
+    free_queue(&p->out);
+    free_framer(&p->in);
+    cancel_timer(&p->timer);
+    cancel_timer(&p->stall_timer);
+    stat_add(&stats->clients, -1);
+    p->next_dead = dead_clients;
+    dead_clients = p;
 }
 
 
-/* Add a client to the head of the linked list */
-void add_player(struct client **top, int fd, struct in_addr addr) {
-    struct client *p = malloc(sizeof(struct client));
+/* Make every client queued by discard_client available for reuse, except
+ * those that io_uring operations have yet to complete for.
+ */
+void free_dead_clients() {
+    struct client *waiting = NULL;
+    while (dead_clients != NULL) {
+        struct client *t = dead_clients->next_dead;
+        if (dead_clients->uring_ops > 0) {
+            dead_clients->next_dead = waiting;
+            waiting = dead_clients;
+        } else {
+            release_name(dead_clients->name_id);
+            dead_clients->next = free_clients;
+            free_clients = dead_clients;
+        }
+        dead_clients = t;
+    }
+    dead_clients = waiting;
+}
 
-    if (!p) {
-        perror("malloc");
-            exit(1);
+
+/* Removes client p from the linked list top and closes its socket.
+ * Also removes socket descriptor from epfd
+ */
+void remove_player(struct client **top, struct client *p) {
+    unlink_client(top, p);
+    discard_client(p);
+}
+
+
+/* Disconnect p, who may or may not have entered a name yet */
+void drop_client(struct client *p){
+    if (p->active){
+        leave_handler(p->game, p);
+    } else {
+        remove_player(&new_players, p);
+    }
+}
+
+
+/* Disconnect the client whose timer t expired: either it took longer than
+ * name_timeout seconds to enter a name, or it has sent nothing for
+ * idle_timeout seconds.
+ */
+void client_expired(struct timer *t){
+    struct client *p = container_of(t, struct client, timer);
+    log_info("[%d] Timed out %s", p->fd, p->active ? "while idle" : "entering a name");
+    drop_client(p);
+}
+
+
+/* Disconnect the client whose stall_timer t expired if its output has made
+ * no progress for max_stall seconds, or check again once it could have.
+ */
+void stall_expired(struct timer *t){
+    struct client *p = container_of(t, struct client, stall_timer);
+    int stalled = queue_stalled(&p->out);
+    if (stalled >= max_stall) {
+        log_info("[%d] Timed out while not reading", p->fd);
+        drop_client(p);
+    } else if (stalled >= 0) {
+        arm_timer(t, (max_stall - stalled) * 1000L);
     }
+}
+
+
+/* Add a client to the head of the linked list */
+void add_player(struct client **top, int fd, struct in_addr addr) {
+    struct client *p = alloc_client();
 
-    printf("Adding client %s\n", inet_ntoa(addr));
+    log_debug("Adding client %s", inet_ntoa(addr));
 
     p->fd = fd;
+    p->active = 0;
+    p->game = NULL;
     p->ipaddr = addr;
-    p->name[0] = '\0';
-    p->in_ptr = p->inbuf;
-    p->inbuf[0] = '\0';
-    p->next = *top;
-    *top = p;
-}
-
-
-/* Removes client from the linked list and closes its socket.
- * Also removes socket descriptor from allset 
- */
-void remove_player(struct client **top, int fd) {
-    struct client **p;
-
-    for (p = top; *p && (*p)->fd != fd; p = &(*p)->next);
-    // Now, p points to (1) top, or (2) a pointer to another client
-    // This avoids a special case for removing the head of the list
-    if (*p) {
-        struct client *t = (*p)->next;
-        printf("Removing client %d %s\n", fd, inet_ntoa((*p)->ipaddr));
-        FD_CLR((*p)->fd, &allset);
-        close((*p)->fd);
-        free(*p);
-        *p = t;
-    } else {
-        fprintf(stderr, "Trying to remove fd %d, but I don't know about it\n", fd);
+    p->name_id = NO_NAME;
+    p->name = name_str(NO_NAME);
+    init_framer(&p->in);
+    p->line = NULL;
+    init_queue(&p->out);
+    init_timer(&p->timer, client_expired);
+    init_timer(&p->stall_timer, stall_expired);
+    if (name_timeout > 0) {
+        arm_timer(&p->timer, name_timeout * 1000L);
     }
+    p->guesses = 0;
+    p->binary = 0;
+    p->lagging = 0;
+    p->next_dead = NULL;
+    p->uring_ops = 0;
+    p->conn = next_conn++;
+    link_client(top, p);
 }
 
 
-/* Remove player from new_list and add to game->head
+/* Remove player from new_list and add to game->head, where game was
+ * returned by open_room.
 */
 void activate_player(struct client **new_list, struct game_state *game, struct client *new_p){
-    struct client **p;
     //remove player from new_list
-    for (p = new_list; *p && (*p)->fd != new_p->fd; p = &(*p)->next);
-    if (*p){
-        struct client *t = (*p)->next;
-        *p = t;
-    }
+    unlink_client(new_list, new_p);
 
     //add player to head of game
-    new_p->next = game->head;
-    game->head = new_p;
+    new_p->active = 1;
+    join_room(&rooms, game, new_p);
+    if (idle_timeout > 0) {
+        arm_timer(&new_p->timer, idle_timeout * 1000L);
+    } else {
+        cancel_timer(&new_p->timer);
+    }
 }
 
 
-/* Read in the name written by the client pointed to by new_p.
+/* Read in the name written by the client pointed to by new_p, and
+register it if no other client on the server has it.
 - If an error occurs, return -1.
 - If name is already taken, return -2.
 - If a newline has yet to be found, return -3
+- If there is no more data to read, return -4
+- If name is too long, return -5
+- If the line asks for the binary protocol instead, return -6
 - Otherwise, return length of name inputted.
 */
-int ask_for_name(struct game_state *game, struct client *new_p){
-    int buf_offset = strlen(new_p->name) * sizeof(char);
-    int num_read = read(new_p->fd, new_p->name + buf_offset, sizeof(char) * MAX_NAME);
-    printf("[%d] Read %d bytes\n", new_p->fd, num_read);
-
-    // If there are errors
-    if (num_read <= 0){
+int ask_for_name(struct client *new_p){
+    int status = read_line(new_p);
+    if (status == -1){
         return -1;
+    } else if (status == -2){
+        return -4;
+    } else if (status > 0){
+        return -3;
     }
-    // If network newline was not found
-    int net_nl = find_network_newline(new_p->name, MAX_NAME);
-    if (net_nl == -1){
-        new_p->name[buf_offset + num_read] = '\0';
-        return -3;	
+
+    int len = strlen(new_p->line);
+    if (strcmp(new_p->line, PROTO_REQUEST) == 0){
+        return -6;
+    } else if (len >= MAX_NAME){
+        return -5;
+    } else if (len == 0){
+        return 0;
     }
 
-    //If no errors and reading has finished
-    new_p->name[net_nl] = '\0';
-    new_p->name[net_nl+1] = '\0';
-    printf("[%d] Found newline %s\n", new_p->fd, new_p->in_ptr);
-    
-    // Check if name already exists among active players
-    struct client *curr = game->head;
-    while(curr != NULL){
-        if (strcmp(curr->name, new_p->name) == 0){
-            return -2;
-        }
-        curr = curr->next;
+    new_p->name_id = register_name(new_p->line);
+    if (new_p->name_id == NO_NAME){
+        return -2;
     }
-    return strlen(new_p->name);
+    new_p->name = name_str(new_p->name_id);
+    return len;
 }
 
 
@@ -139,62 +365,1318 @@ int ask_for_name(struct game_state *game, struct client *new_p){
 Prerequisites: player is a pointer to an active player in the game
 */
 void leave_handler(struct game_state *game, struct client *player){  
+    // Player may already have left during this batch of events
+    if (player->fd == -1){
+        return;
+    }
+    unlink_client(&game->head, player);
+    engine_leave(game, player, &events);
+
+    // Remove from epfd and close now; free once the batch is done
+    discard_client(player);
+    leave_room(&rooms, game);
+
+    // Announce departure and reannounce turn to the remaining players
+    deliver_events(game, &events);
+}
+
+
+/* Move the turn on when the player who has it took longer than
+ * turn_timeout seconds to guess.
+ */
+void turn_expired(struct timer *t){
+    struct game_state *game = container_of(t, struct game_state, turn_timer);
+    record_event(REC_TURN_TIMEOUT, game->id, NULL, 0);
+    engine_timeout(game, &events);
+    deliver_events(game, &events);
+}
+
+
+/* Handle one complete line, or a partial read, from active player p.
+ * Return 1 if there may be more input to read from p, 0 otherwise.
+ */
+int handle_player_input(struct client *p){
+    struct game_state *game = p->game;
+    uint64_t start = now_ns();
+    int read_status = read_line(p);
+
+    // If reading has found neither a line nor more data
+    if (read_status == -1){
+        leave_handler(game, p);
+        return 0;
+    } else if (read_status == -2){
+        return 0;
+    } else if (read_status > 0){
+        return 1;
+    }
+
+    // Commands about scores are answered here, since the engine has no
+    // access to them
+    int outcome = 0;
+    if (!answer_scores(p, p->line)) {
+        outcome = engine_line(game, p, p->line, &events);
+        deliver_events(game, &events);
+    }
+
+    // If the line was a valid guess (single, lowercase, unguessed letter)
+    if (outcome > 0){
+        stat_add(&stats->guesses, 1);
+        if (outcome == 2){
+            stat_add(&stats->games, 1);
+        }
+        metrics_turn_queued(start);
+    }
+    return p->fd != -1;
+}
+
+
+/* Handle input from p, who has not yet entered a name. Once the name is
+ * complete, p joins a room that has space for another player.
+ * Return 1 if there may be more input to read from p, 0 otherwise.
+ */
+int handle_name_input(struct client *p){
+    uint64_t start = now_ns();
+    int name_len = ask_for_name(p);
+    char name_msg[MAX_MSG];
+    char frame[MAX_FRAME];
+    // if name is valid
+    if (name_len > 0){
+        struct game_state *game = open_room(&rooms);
+        activate_player(&new_players, game, p);
+        engine_join(game, p, &events);
+        deliver_events(game, &events);
+        metrics_latency(LAT_NAME, start);
+
+    //if name not finished writing, just pass
+    } else if (name_len == -3){
+
+    //if there is nothing more to read
+    } else if (name_len == -4){
+        return 0;
+
+    //if the client switches to the binary protocol
+    } else if (name_len == -6){
+        p->binary = 1;
+        int frame_len = frame_hello(frame);
+        if (client_write_shared(p, tick_copy(frame, frame_len), frame_len) == -1){
+            remove_player(&new_players, p);
+            return 0;
+        }
+
+    //if name is NOT valid
+    } else {
+        if (name_len == 0){
+            sprintf(name_msg, "Please enter a non-empty name...\r\n");
+        } else if (name_len == -2){
+            sprintf(name_msg, "That name is already taken. Try another name\r\n");
+        } else if (name_len == -5){
+            sprintf(name_msg, "That name is too long. Try a shorter name\r\n");
+        }
+        if (name_len == -1 || client_write(p, name_msg, strlen(name_msg)) == -1){
+            remove_player(&new_players, p);
+            return 0;
+        }
+        metrics_latency(LAT_NAME, start);
+    }
+    return p->fd != -1;
+}
+
+
+/* Queue a send of the output being sent to p to the kernel */
+void submit_send(struct client *p){
+    uring_send(p->fd, p->out.sending + p->out.send_start, p->out.send_len, p);
+    p->uring_ops++;
+    metrics_add(CTR_WRITE_CALLS, 1);
+}
+
+
+/* Send the output of this tick to p: with a writev, or with io_uring once
+ * the send before it, if any, has completed.
+ * Return 0 on success, or -1 if the socket failed or p is too slow.
+ */
+int send_output(struct client *p){
+    if (replaying){
+        queue_discard(&p->out);
+        return 0;
+    }
+    if (!use_io_uring){
+        return queue_send(&p->out, p->fd);
+    }
+    if (queue_collect(&p->out) == -1){
+        return -1;
+    }
+    if (queue_start_send(&p->out)){
+        submit_send(p);
+    }
+    return 0;
+}
 
-    // Special case when the player is at the head of the list
-    if (game->head == player){
-        if (player->next == NULL){ // if player is the only person remaining.
-            game->head = NULL;
-            game->has_next_turn = NULL;
-        } else { // otherwise
-            game->head = player->next;
+
+/* Send every client written to during this tick its output, with one writev
+ * per client. Disconnecting a client whose socket failed writes to the other
+ * players in its room, so this repeats until no output is left.
+ */
+void flush_clients(){
+    while (dirty_clients != NULL){
+        struct client *p = dirty_clients;
+        dirty_clients = NULL;
+        while (p != NULL){
+            struct client *next = p->next_dirty;
+            if (p->fd != -1 && (p->lagging || send_output(p) == -1)){
+                drop_client(p);
+            } else if (p->fd != -1 && p->stall_timer.pprev == NULL
+                    && queue_stalled(&p->out) >= 0){
+                // Output was left waiting: make sure it gets checked on,
+                // even if nothing more is ever written to p
+                arm_timer(&p->stall_timer, max_stall * 1000L);
+            }
+            p = next;
         }
     }
+    metrics_turns_sent();
+    end_tick();
+}
 
 
-    // Reconnect the remaining players in the linked list and announce departure
-    // broadcast() cannot be used in this function as it will cause an infinite loop.
-    struct client *curr = game->head;
-    char leave_msg[MAX_MSG];
-    sprintf(leave_msg, "\r\n%s has left the game\r\n", player->name);
-    while (curr != NULL){
-        // send message that player has disconnected:
-        if (curr != player){
-            game_write(game, curr, leave_msg, strlen(leave_msg));    
+/* Register fd with epfd for events in edge-triggered mode, carrying the
+ * pointer data.
+ * Return 0 on success and -1 on failure.
+ */
+int watch_fd(int fd, unsigned int events, void *data){
+    struct epoll_event ev;
+    ev.events = events | EPOLLET;
+    ev.data.ptr = data;
+    metrics_add(CTR_SYSCALLS, 1);
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1){
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Set up a client for the new connection fd from addr, and greet it.
+ * The time the connection was first seen is given by start.
+ */
+void greet_client(int fd, struct in_addr addr, uint64_t start){
+    stat_add(&stats->accepted, 1);
+    stat_add(&stats->clients, 1);
+    add_player(&new_players, fd, addr);
+    struct client *p = new_players;
+    record_event(REC_CONNECT, p->conn, NULL, 0);
+    if (replaying) {
+        // Input is handed to the framer by replay_worker
+    } else if (use_io_uring) {
+        uring_recv(fd, p);
+        p->uring_ops++;
+    } else if (watch_fd(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, p) == -1) {
+        remove_player(&new_players, p);
+        return;
+    }
+    char *greeting = WELCOME_MSG;
+    if(client_write(p, greeting, strlen(greeting)) == -1) {
+        log_warn("Write to client %s failed", inet_ntoa(addr));
+        remove_player(&new_players, p);
+        return;
+    };
+    metrics_latency(LAT_ACCEPT, start);
+}
+
+
+/* Turn away every pending connection on listenfd, since there are no file
+ * descriptors left for them. If some could not be, because the spare
+ * descriptor was lost to another thread, try again every ACCEPT_BACKOFF_MS.
+ */
+void shed(int listenfd){
+    int n = 0;
+    int status = shed_connections(listenfd, &spare_fd, BUSY_MSG, &n);
+    if (n > 0) {
+        stat_add(&stats->shed, n);
+        log_warn("Out of file descriptors: turned away %d connection(s)", n);
+    }
+    if (status == -1 && shed_listenfd == -1) {
+        log_warn("Out of file descriptors with connections still pending; "
+            "retrying every %d ms", ACCEPT_BACKOFF_MS);
+    } else if (status == 0 && shed_listenfd != -1) {
+        log_info("Turned away every pending connection");
+    }
+    shed_listenfd = status == -1 ? listenfd : -1;
+    if (status == -1) {
+        arm_timer(&shed_timer, ACCEPT_BACKOFF_MS);
+    }
+}
+
+
+/* Try again to turn away the connections shed left pending */
+void shed_expired(struct timer *t){
+    shed(shed_listenfd);
+}
+
+
+/* Handle every complete line of input from p, until more is needed */
+void handle_input(struct client *p){
+    int more = 1;
+    while (more && p->fd != -1) {
+        if (p->active) {
+            more = handle_player_input(p);
+        } else {
+            more = handle_name_input(p);
         }
-        // remove player from linked list
-        if (curr->next == player){
-            curr->next = player->next;
-        } 
-        curr = curr->next;
     }
+}
 
-    // If it was currently player's turn
-    if (game->has_next_turn == player){
-        advance_turn(game);
+
+/* Free what the batch of events that was just handled left behind */
+void end_batch(){
+    flush_clients();
+    free_dead_clients();
+    free_retired_rooms(&rooms);
+    __atomic_store_n(&stats->rooms, rooms.num_rooms, __ATOMIC_RELAXED);
+    record_batch();
+}
+
+
+/* A live upgrade hands every socket and game over to a newly started
+ * server, which connects to the upgrade socket of this one. Every worker
+ * is woken up and parked between two batches of events, where it appends
+ * its clients and rooms to handover. Once the new server has them, this one
+ * exits; if the handover fails, the workers carry on as if nothing happened.
+ * The new server splits what it was handed over among its own workers.
+ */
+int upgrade_requested = 0;
+int num_parked = 0;
+struct snapshot handover;
+pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER;
+
+// What was handed over to this process, and how many workers share it
+struct snapshot handed_over;
+int handed_over_workers = 0;
+
+
+/* Append client p to s: its socket, its name, and the input and output
+ * that have yet to be handled.
+ */
+void save_client(struct snapshot *s, struct client *p) {
+    snapshot_put_fd(s, p->fd);
+    snapshot_put_int(s, (int) p->ipaddr.s_addr);
+    snapshot_put_int(s, p->guesses);
+    snapshot_put_int(s, p->binary);
+    snapshot_put_str(s, p->name, strlen(p->name));
+    snapshot_put_str(s, p->in.len > 0 ? p->in.buf + p->in.start : "", p->in.len);
+    snapshot_put_str(s, p->out.len > 0 ? p->out.data + p->out.start : "", p->out.len);
+}
+
+
+/* Append game and its players to s, in turn order */
+void save_room(struct snapshot *s, struct game_state *game) {
+    snapshot_put_str(s, game->word, game->word_len);
+    snapshot_put_int(s, game->guessed);
+    snapshot_put_int(s, game->guesses_left);
+    snapshot_put_int(s, game->band);
+    snapshot_put_int(s, game->num_players);
+
+    // Players are restored by adding them to the head of the list, so they
+    // are saved from the tail
+    struct client *tail = game->head;
+    while (tail != NULL && tail->next != NULL) {
+        tail = tail->next;
+    }
+    int turn = -1, i = 0;
+    for (struct client *p = tail; p != NULL; p = p->prev, i++) {
+        if (p == game->has_next_turn) {
+            turn = i;
+        }
     }
+    snapshot_put_int(s, turn);
+    for (struct client *p = tail; p != NULL; p = p->prev) {
+        save_client(s, p);
+    }
+}
 
-    // Reannounce turn. Won't cause an infinite loop since player has already been removed.
-    announce_turn(game);
 
-    // Remove from allset, close and free
-    printf("Removing client %d %s\n", player->fd, inet_ntoa(player->ipaddr));
-    FD_CLR(player->fd, &allset);
-    close(player->fd);
-    free(player);
+/* Append every client and room of the current worker to s */
+void save_worker(struct snapshot *s) {
+    int count = 0;
+    for (struct client *p = new_players; p != NULL; p = p->next) {
+        count++;
+    }
+    snapshot_put_int(s, count);
+    for (struct client *p = new_players; p != NULL; p = p->next) {
+        save_client(s, p);
+    }
+    count = 0;
+    for (struct game_state *game = rooms.all; game != NULL; game = game->next_room) {
+        count++;
+    }
+    snapshot_put_int(s, count);
+    for (struct game_state *game = rooms.all; game != NULL; game = game->next_room) {
+        save_room(s, game);
+    }
 }
 
 
+/* Save the state of the current worker to handover, and wait until the
+ * upgrade has failed. If it succeeds, the process exits meanwhile.
+ */
+void park_worker(void) {
+    pthread_mutex_lock(&park_lock);
+    save_worker(&handover);
+    num_parked++;
+    pthread_cond_broadcast(&park_cond);
+    while (__atomic_load_n(&upgrade_requested, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&park_cond, &park_lock);
+    }
+    num_parked--;
+    pthread_mutex_unlock(&park_lock);
+}
+
 
-int main(int argc, char **argv) {
-    int clientfd, maxfd, nready;
+/* Read a client saved by save_client from s and, if keep is non-zero, add
+ * it to the new players of the current worker.
+ * Return the client, or NULL if it was not kept.
+ */
+struct client *restore_client(struct snapshot *s, int keep) {
+    int fd = snapshot_get_fd(s);
+    struct in_addr addr;
+    addr.s_addr = (in_addr_t) snapshot_get_int(s);
+    int guesses = snapshot_get_int(s);
+    int binary = snapshot_get_int(s);
+    int name_len, in_len, out_len;
+    const char *name = snapshot_get_str(s, &name_len);
+    const char *in = snapshot_get_str(s, &in_len);
+    const char *out = snapshot_get_str(s, &out_len);
+    if (name_len >= MAX_NAME || in_len > MAX_BUF) {
+        s->failed = 1;
+    }
+    if (!keep || s->failed) {
+        return NULL;
+    }
+
+    stat_add(&stats->clients, 1);
+    add_player(&new_players, fd, addr);
+    struct client *p = new_players;
+    p->guesses = guesses;
+    p->binary = binary != 0;
+    if (name_len > 0) {
+        char buf[MAX_NAME];
+        memcpy(buf, name, name_len);
+        buf[name_len] = '\0';
+        p->name_id = register_name(buf);
+        p->name = name_str(p->name_id);
+    }
+    framer_feed(&p->in, in, in_len);
+    if (replaying) {
+        // The descriptor of a replayed client is its connection number
+        p->conn = fd;
+    } else if (use_io_uring) {
+        uring_recv(fd, p);
+        p->uring_ops++;
+    } else if (watch_fd(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, p) == -1) {
+        remove_player(&new_players, p);
+        return NULL;
+    }
+    // The output is already in the protocol of p
+    if (out_len > 0 && client_write_shared(p, tick_copy(out, out_len), out_len) == -1) {
+        remove_player(&new_players, p);
+        return NULL;
+    }
+    return p;
+}
+
+
+/* Read a room saved by save_room from s and, if keep is non-zero, host it
+ * and its players on the current worker.
+ * Return the room, or NULL if it was not kept.
+ */
+struct game_state *restore_room(struct snapshot *s, int keep) {
+    int word_len;
+    const char *word = snapshot_get_str(s, &word_len);
+    uint32_t guessed = snapshot_get_int(s);
+    int guesses_left = snapshot_get_int(s);
+    int band = snapshot_get_int(s);
+    int num_players = snapshot_get_int(s);
+    int turn = snapshot_get_int(s);
+    if (word_len >= MAX_WORD || num_players < 0 || band < 0 || band > BAND_ANY) {
+        s->failed = 1;
+    }
+
+    struct game_state *game = NULL;
+    if (keep && !s->failed) {
+        game = new_room(&rooms);
+        memcpy(game->word, word, word_len);
+        game->word[word_len] = '\0';
+        game->word_len = word_len;
+        index_word(game);
+        game->guessed = guessed;
+        game->remaining = game->in_word & ~guessed;
+        game->guesses_left = guesses_left;
+        game->band = band;
+        render_status(game);
+    }
+    for (int i = 0; i < num_players && !s->failed; i++) {
+        struct client *p = restore_client(s, game != NULL);
+        if (p == NULL) {
+            continue;
+        }
+        if (p->name_id == NO_NAME) {
+            // Names were unique in the old server, so this cannot happen
+            remove_player(&new_players, p);
+            continue;
+        }
+        activate_player(&new_players, game, p);
+        if (i == turn) {
+            game->has_next_turn = p;
+        }
+    }
+    if (game != NULL) {
+        if (game->has_next_turn == NULL) {
+            game->has_next_turn = game->head;
+        }
+        restart_turn_timer(game);
+    }
+    return game;
+}
+
+
+/* Record client p, or game and its players if game is not NULL, which the
+ * current worker has just taken over, so that a replay can take them over
+ * too. The event's id is the number of clients, and its bytes are their
+ * connection numbers followed by what save_client or save_room write, with
+ * a replay's descriptors standing in for the sockets.
+ */
+void record_restored(struct client *p, struct game_state *game) {
+    if (!recording) {
+        return;
+    }
+    struct snapshot s, rec;
+    init_snapshot(&s);
+    init_snapshot(&rec);
+    if (game != NULL) {
+        save_room(&s, game);
+    } else {
+        save_client(&s, p);
+    }
+    // The sockets were saved in the order save_room goes through the players
+    struct client *tail = game != NULL ? game->head : p;
+    while (game != NULL && tail != NULL && tail->next != NULL) {
+        tail = tail->next;
+    }
+    for (int i = 0; i < s.num_fds; i++, tail = tail->prev) {
+        snapshot_put(&rec, &tail->conn, sizeof(tail->conn));
+    }
+    snapshot_put(&rec, s.data, s.len);
+    record_event(game != NULL ? REC_RESTORE_ROOM : REC_RESTORE_CLIENT, s.num_fds,
+        rec.data, rec.len);
+    free_snapshot(&s);
+    free_snapshot(&rec);
+}
+
+
+/* Read everything handed over from s, and restore the share of the worker
+ * with the given index out of num_workers: every num_workers-th room or
+ * new player, starting at index. An index of -1 restores nothing, which
+ * checks that s can be read.
+ * Return 0 on success and -1 if s is not valid.
+ */
+int restore_state(struct snapshot *s, int index, int num_workers) {
+    int num_sections = snapshot_get_int(s);
+    int item = 0;
+    for (int i = 0; i < num_sections && !s->failed; i++) {
+        int count = snapshot_get_int(s);
+        for (int j = 0; j < count && !s->failed; j++, item++) {
+            struct client *p = restore_client(s, item % num_workers == index);
+            if (p != NULL) {
+                record_restored(p, NULL);
+            }
+        }
+        count = snapshot_get_int(s);
+        for (int j = 0; j < count && !s->failed; j++, item++) {
+            struct game_state *game = restore_room(s, item % num_workers == index);
+            if (game != NULL) {
+                record_restored(NULL, game);
+            }
+        }
+    }
+    return s->failed || s->pos != s->len ? -1 : 0;
+}
+
+
+/* Take on the share of the current worker w of what was handed over */
+void restore_worker(struct worker *w) {
+    if (handed_over_workers == 0) {
+        return;
+    }
+    // Each worker reads with its own position
+    struct snapshot s = handed_over;
+    restore_state(&s, w->id, handed_over_workers);
+    log_info("Worker %d took over %ld clients in %d rooms", w->id,
+        __atomic_load_n(&stats->clients, __ATOMIC_RELAXED), rooms.num_rooms);
+    end_batch();
+}
+
+
+/* Handle a signal that only interrupts a worker's wait for events */
+void wake_up(int sig) {
+}
+
+
+/* Hand every socket and game over to the server that connected to the
+ * upgrade socket on soc, and exit. Return only if the handover failed.
+ */
+void hand_over(struct upgrade *u, int soc) {
+    uint64_t start = now_ns();
+    pthread_mutex_lock(&park_lock);
+    init_snapshot(&handover);
+    snapshot_put_int(&handover, u->num_workers);
+    for (int i = 0; i < u->num_workers; i++) {
+        snapshot_put_fd(&handover, u->workers[i].listenfd);
+    }
+    snapshot_put_int(&handover, u->num_workers);
+
+    // A worker may miss the signal if it arrives just before it starts to
+    // wait, so it is sent again until every worker has parked
+    __atomic_store_n(&upgrade_requested, 1, __ATOMIC_RELEASE);
+    while (num_parked < u->num_workers) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        for (int i = 0; i < u->num_workers; i++) {
+            pthread_kill(u->workers[i].thread, SIGUSR2);
+        }
+        pthread_cond_timedwait(&park_cond, &park_lock, &ts);
+    }
+    pthread_mutex_unlock(&park_lock);
+    uint64_t parked = now_ns();
+
+    // The new server loads the statistics as they are on disk
+    scores_flush();
+
+    // The new server uses nothing it was sent until it is told to commit,
+    // so that only one of the two servers ever serves the clients
+    char ack;
+    char decision = UPGRADE_COMMIT;
+    struct pollfd pfd = {soc, POLLIN, 0};
+    if (send_snapshot(soc, &handover) == 0
+            && poll(&pfd, 1, UPGRADE_ACK_TIMEOUT) == 1 && read(soc, &ack, 1) == 1
+            && write(soc, &decision, 1) == 1) {
+        log_info("Handed %d sockets over in %.2f ms (workers parked in %.2f ms)",
+            handover.num_fds, (now_ns() - start) / 1e6, (parked - start) / 1e6);
+        exit(0);
+    }
+
+    // A new server that acknowledges late reads this, or finds the
+    // connection closed, and exits
+    decision = UPGRADE_ABORT;
+    if (write(soc, &decision, 1) != 1) {
+        // Nothing more to tell a new server that has gone away
+    }
+    log_warn("The new server did not take over; carrying on");
+    pthread_mutex_lock(&park_lock);
+    __atomic_store_n(&upgrade_requested, 0, __ATOMIC_RELEASE);
+    free_snapshot(&handover);
+    pthread_cond_broadcast(&park_cond);
+    pthread_mutex_unlock(&park_lock);
+}
+
+
+/* Wait for a new server to connect to the upgrade socket, and hand over
+ * to it. This runs on its own thread.
+ */
+void *run_upgrade(void *arg) {
+    struct upgrade *u = arg;
+    int failures = 0;
+    while (1) {
+        int fd = accept(u->listenfd, NULL, NULL);
+        if (fd < 0) {
+            accept_backoff("upgrade", &failures);
+            continue;
+        }
+        failures = 0;
+        hand_over(u, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+
+/* Take over from the server listening on the upgrade socket at path, if
+ * any: receive its sockets and games into handed_over, and give its
+ * listening sockets to the num_workers workers, opening more on server if
+ * needed. Return 1 once the old server has let go, or 0 if no server is
+ * listening there.
+ */
+int take_over(const char *path, struct worker *workers, int num_workers,
+        struct sockaddr_in *server) {
+    int soc = connect_local_socket(path);
+    if (soc == -1) {
+        return 0;
+    }
+    uint64_t start = now_ns();
+    init_snapshot(&handed_over);
+    if (recv_snapshot(soc, &handed_over) == -1) {
+        fprintf(stderr, "Could not take over from the server at %s\n", path);
+        exit(1);
+    }
+    int num_listeners = snapshot_get_int(&handed_over);
+    if (num_listeners < 1) {
+        fprintf(stderr, "The server at %s sent no listening socket\n", path);
+        exit(1);
+    }
+    for (int i = 0; i < num_listeners; i++) {
+        int fd = snapshot_get_fd(&handed_over);
+        if (i < num_workers) {
+            workers[i].listenfd = fd;
+        } else {
+            close(fd);
+        }
+    }
+    if (num_listeners > num_workers) {
+        log_warn("Closed %d listening socket(s) of the old server; connections "
+            "queued on them were reset", num_listeners - num_workers);
+    }
+    // The old server's sockets were opened with SO_REUSEPORT if it had more
+    // than one worker, and the new ones can only share its port if so.
+    // Otherwise, the extra workers share its one socket.
+    int reuse_port = 0;
+    socklen_t optlen = sizeof(reuse_port);
+    if (getsockopt(workers[0].listenfd, SOL_SOCKET, SO_REUSEPORT,
+            &reuse_port, &optlen) == -1) {
+        reuse_port = 0;
+    }
+    for (int i = num_listeners; i < num_workers; i++) {
+        if (reuse_port) {
+            workers[i].listenfd = set_up_socket(server, listen_backlog, 1);
+        } else if ((workers[i].listenfd = dup(workers[0].listenfd)) == -1) {
+            perror("dup");
+            exit(1);
+        }
+    }
+    if (num_listeners < num_workers && !reuse_port) {
+        log_info("The server at %s had one worker: its listening socket is "
+            "shared by the %d workers of this one", path, num_workers);
+    }
+
+    // Make sure the rest can be read before the old server goes away
+    struct snapshot check = handed_over;
+    if (restore_state(&check, -1, 1) == -1) {
+        fprintf(stderr, "The server at %s sent a snapshot that is not valid\n", path);
+        exit(1);
+    }
+    char ack = 1;
+    if (write(soc, &ack, 1) != 1) {
+        perror("write");
+        exit(1);
+    }
+
+    // The old server may have given up waiting for the ack and carried on
+    // with the same sockets, in which case it must be the only one to use them
+    char decision;
+    ssize_t n;
+    do {
+        n = read(soc, &decision, 1);
+    } while (n == -1 && errno == EINTR);
+    if (n != 1 || decision != UPGRADE_COMMIT) {
+        fprintf(stderr, "The server at %s carried on instead of handing over\n", path);
+        exit(1);
+    }
+    close(soc);
+    handed_over_workers = num_workers;
+    log_info("Took over %d sockets from the server at %s in %.2f ms",
+        handed_over.num_fds, path, (now_ns() - start) / 1e6);
+    return 1;
+}
+
+
+/* Handle the completion of a multishot accept on listenfd that accepted
+ * the connection res, or failed with error -res.
+ */
+void accept_completed(int listenfd, int res, int more){
+    if (res >= 0) {
+        // The address is only used for logging
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        peer.sin_addr.s_addr = INADDR_ANY;
+        if (LOG_DEBUG >= LOG_LEVEL) {
+            getpeername(res, (struct sockaddr *)&peer, &peer_len);
+        }
+        greet_client(res, peer.sin_addr, now_ns());
+    } else if (res == -EMFILE || res == -ENFILE || res == -ENOBUFS || res == -ENOMEM) {
+        shed(listenfd);
+    } else {
+        log_warn("accept: %s", strerror(-res));
+    }
+    if (!more) {
+        uring_accept(listenfd);
+    }
+}
+
+
+/* Handle the completion of a multishot receive for p that received res
+ * bytes into the buffer of cqe, or failed with error -res.
+ */
+void recv_completed(struct client *p, const struct io_uring_cqe *cqe, int more){
+    int res = cqe->res;
+    if (p->fd != -1 && res > 0) {
+        char *data = uring_buffer(cqe);
+        log_debug("[%d] Received %d bytes", p->fd, res);
+        if (p->active && idle_timeout > 0) {
+            arm_timer(&p->timer, idle_timeout * 1000L);
+        }
+        // A receive can hold more than fits in the framer at once
+        for (int used = 0; used < res && p->fd != -1; ) {
+            int n = framer_feed(&p->in, data + used, res - used);
+            record_event(REC_INPUT, p->conn, data + used, n);
+            used += n;
+            handle_input(p);
+        }
+    }
+    uring_recycle(cqe);
+    if (p->fd == -1) {
+        return;
+    }
+    if (res == 0 || (res < 0 && res != -ENOBUFS)) {
+        drop_client(p);
+    } else if (!more) {
+        // The receive stopped, for instance since buffers ran out
+        uring_recv(p->fd, p);
+        p->uring_ops++;
+    }
+}
+
+
+/* Handle the completion of a send to p that sent res bytes, or failed with
+ * error -res.
+ */
+void send_completed(struct client *p, int res){
+    if (p->fd == -1) {
+        queue_abort_send(&p->out);
+    } else if (res == -EAGAIN || res == -EINTR) {
+        submit_send(p);
+    } else if (res < 0) {
+        queue_abort_send(&p->out);
+        drop_client(p);
+    } else if (queue_sent(&p->out, res)) {
+        submit_send(p);
+    }
+}
+
+
+/* Run the event loop of worker w with io_uring until the process exits.
+ * Connections are accepted and received from by multishot operations, so
+ * the only system call of a tick is the io_uring_enter that submits its
+ * sends and waits for the next completions.
+ */
+void run_uring_loop(struct worker *w) {
+    int timeout = -1;
+    if (uring_init() == -1) {
+        exit(1);
+    }
+    uring_accept(w->listenfd);
+    restore_worker(w);
+    timeout = timer_timeout();
+
+    while (1) {
+        if (uring_wait(timeout) == -1) {
+            perror("io_uring_enter");
+        }
+        run_timers();
+
+        /* Each completion carries the struct client it belongs to. Clients
+         * that are removed while handling them have their fd set to -1 and
+         * are only freed once no operation on them is left.
+         */
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek()) != NULL) {
+            struct client *p = URING_PTR(cqe->user_data);
+            int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+            int op = URING_OP(cqe->user_data);
+            if (op == OP_ACCEPT) {
+                accept_completed(w->listenfd, cqe->res, more);
+            } else {
+                if (!more) {
+                    p->uring_ops--;
+                }
+                if (op == OP_RECV) {
+                    recv_completed(p, cqe, more);
+                } else {
+                    send_completed(p, cqe->res);
+                }
+            }
+            uring_advance();
+        }
+
+        end_batch();
+        timeout = timer_timeout();
+    }
+}
+
+
+/* Run the event loop of worker arg until the process exits */
+void *run_worker(void *arg) {
+    struct worker *w = arg;
+    int clientfd, nready;
     struct client *p;
     struct sockaddr_in q;
-    fd_set rset;
-    
-    if(argc != 2){
-        fprintf(stderr,"Usage: %s <dictionary filename>\n", argv[0]);
+    struct epoll_event events[MAX_EVENTS];
+    int timeout = -1;
+
+    // Rooms are created as players arrive and retired once they are empty.
+    // They all share the dictionary published by main.
+    stats = &w->stats;
+    metrics = &w->metrics;
+    init_rooms(&rooms, ROOM_SIZE);
+    init_timers();
+    seed_words(w->seed);
+    record_worker(w->id, w->seed);
+    init_timer(&shed_timer, shed_expired);
+    spare_fd = reserve_fd();
+    if (spare_fd == -1) {
+        perror("open");
+    }
+    if (set_nonblocking(w->listenfd) == -1) {
+        exit(1);
+    }
+    if (use_io_uring) {
+        run_uring_loop(w);
+    }
+
+    // Create the epoll instance and add the listening socket to it. The
+    // listening socket is the only registration that carries a NULL pointer.
+    epfd = epoll_create1(0);
+    if (epfd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    if (watch_fd(w->listenfd, EPOLLIN, NULL) == -1) {
         exit(1);
     }
+    restore_worker(w);
+    timeout = timer_timeout();
+
+    while (1) {
+        // Stop between two batches while the server is handed over
+        if (__atomic_load_n(&upgrade_requested, __ATOMIC_ACQUIRE)) {
+            park_worker();
+        }
+
+        // Wake up in time for the next timer, if any
+        nready = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        metrics_add(CTR_SYSCALLS, 1);
+        if (nready == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+            }
+            nready = 0;
+        }
+        run_timers();
+
+        /* Each registration carries the struct client it belongs to, so
+         * there is no need to search the lists of clients. Clients that are
+         * removed while handling the batch are only freed after it, and
+         * have their fd set to -1 so that later events for them are skipped.
+         * Since the sockets are edge-triggered, each one is drained until
+         * reading would block.
+         */
+        for (int i = 0; i < nready; i++) {
+            p = events[i].data.ptr;
+
+            if (p == NULL) {
+                // Accept every pending connection
+                uint64_t start = now_ns();
+                while ((clientfd = accept_connection(w->listenfd, &q)) >= 0) {
+                    metrics_add(CTR_SYSCALLS, 1);
+                    greet_client(clientfd, q.sin_addr, start);
+                    start = now_ns();
+                }
+                metrics_add(CTR_SYSCALLS, 1);
+                if (clientfd == -2) {
+                    shed(w->listenfd);
+                }
+                continue;
+            }
+
+            // Write out queued output now that the socket can take it
+            if ((events[i].events & EPOLLOUT) && queue_flush(&p->out, p->fd) == -1) {
+                drop_client(p);
+                continue;
+            }
+
+            if (events[i].events & ~EPOLLOUT) {
+                if (p->active && idle_timeout > 0) {
+                    arm_timer(&p->timer, idle_timeout * 1000L);
+                }
+                handle_input(p);
+            }
+        }
+
+        end_batch();
+        timeout = timer_timeout();
+    }
+    return NULL;
+}
+
+
+/* The recording given to --replay */
+struct replay_log replay;
+
+
+/* Return the client of connection conn, or NULL if it is not connected */
+struct client *replay_client(struct client **conns, unsigned num_conns, unsigned conn) {
+    if (conn >= num_conns || conns[conn] == NULL) {
+        return NULL;
+    }
+    // Clients are reused once they are freed
+    struct client *p = conns[conn];
+    return p->fd != -1 && p->conn == conn ? p : NULL;
+}
+
+
+/* Make p the client of its connection in *conns, which has room for
+ * *num_conns and is grown as needed
+ */
+void replay_connected(struct client ***conns, unsigned *num_conns, struct client *p) {
+    if (p->conn >= *num_conns) {
+        unsigned old = *num_conns;
+        *num_conns = p->conn * 2 + 64;
+        *conns = realloc(*conns, *num_conns * sizeof(struct client *));
+        if (!*conns) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(*conns + old, 0, (*num_conns - old) * sizeof(struct client *));
+    }
+    (*conns)[p->conn] = p;
+}
+
+
+/* Take over the client or room of a REC_RESTORE_CLIENT or REC_RESTORE_ROOM
+ * event rec, with the bytes at data, as record_restored wrote them
+ */
+void replay_restored(const struct record *rec, const char *data,
+        struct client ***conns, unsigned *num_conns) {
+    size_t fds_len = rec->id * sizeof(int);
+    if (fds_len > rec->len) {
+        return;
+    }
+    int *fds = malloc(fds_len + sizeof(int));
+    if (!fds) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(fds, data, fds_len);
+    struct snapshot s;
+    init_snapshot(&s);
+    s.data = (char *) data + fds_len;
+    s.len = rec->len - fds_len;
+    s.fds = fds;
+    s.num_fds = rec->id;
+    if (rec->type == REC_RESTORE_CLIENT) {
+        struct client *p = restore_client(&s, 1);
+        if (p != NULL) {
+            replay_connected(conns, num_conns, p);
+        }
+    } else {
+        struct game_state *game = restore_room(&s, 1);
+        for (struct client *p = game != NULL ? game->head : NULL; p != NULL; p = p->next) {
+            replay_connected(conns, num_conns, p);
+        }
+    }
+    free(fds);
+}
+
+
+/* Go through the recorded events of worker arg again, with no sockets and
+ * as fast as possible: each connection gets its number for a descriptor,
+ * input is handed to the framer as it was received, and output is dropped
+ * at the end of each batch. Timers do not run; the turns that ran out of
+ * time and the clients that were disconnected are in the recording.
+ */
+void *run_replay(void *arg) {
+    struct worker *w = arg;
+    struct client **conns = NULL;   // The client of each connection
+    unsigned num_conns = 0;
+    struct in_addr addr = {INADDR_ANY};
+    struct record rec;
+    const char *data;
+    size_t pos = 0;
+    long events = 0;
+
+    stats = &w->stats;
+    metrics = &w->metrics;
+    init_rooms(&rooms, ROOM_SIZE);
+    index_rooms(&rooms);
+    use_private_names();
+    init_timers();
+    uint64_t start = now_ns();
+    while ((data = next_record(&replay, &pos, w->id, &rec)) != NULL) {
+        struct client *p = replay_client(conns, num_conns, rec.id);
+        events++;
+        if (rec.type == REC_SEED) {
+            seed_words(rec.id);
+        } else if (rec.type == REC_CONNECT) {
+            greet_client(rec.id, addr, now_ns());
+            if (new_players != NULL && new_players->fd == (int) rec.id) {
+                new_players->conn = rec.id;
+                replay_connected(&conns, &num_conns, new_players);
+            }
+        } else if (rec.type == REC_RESTORE_CLIENT || rec.type == REC_RESTORE_ROOM) {
+            replay_restored(&rec, data, &conns, &num_conns);
+        } else if (rec.type == REC_INPUT && p != NULL) {
+            for (int used = 0; used < rec.len && p->fd != -1; ) {
+                used += framer_feed(&p->in, data + used, rec.len - used);
+                handle_input(p);
+            }
+        } else if (rec.type == REC_CLOSE && p != NULL) {
+            drop_client(p);
+        } else if (rec.type == REC_TURN_TIMEOUT) {
+            struct game_state *game = find_room(&rooms, rec.id);
+            if (game != NULL && game->has_next_turn != NULL) {
+                turn_expired(&game->turn_timer);
+            }
+        } else if (rec.type == REC_BATCH) {
+            end_batch();
+        }
+    }
+    end_batch();
+    double elapsed = (now_ns() - start) / 1e9;
+    log_info("Worker %d replayed %ld events in %.3f s (%.0f events/s, %ld guesses, "
+        "%ld games)", w->id, events, elapsed, elapsed > 0 ? events / elapsed : 0,
+        w->stats.guesses, w->stats.games);
+    free(conns);
+    return NULL;
+}
+
+
+/* Print the statistics of each of the num_workers workers, and their total */
+void print_stats(struct worker *workers, int num_workers) {
+    struct worker_stats total = {0, 0, 0, 0, 0, 0};
+    printf("%-8s %10s %10s %10s %10s %10s %10s\n",
+        "worker", "accepted", "clients", "rooms", "guesses", "games", "shed");
+    for (int i = 0; i < num_workers; i++) {
+        struct worker_stats *s = &workers[i].stats;
+        long accepted = __atomic_load_n(&s->accepted, __ATOMIC_RELAXED);
+        long clients = __atomic_load_n(&s->clients, __ATOMIC_RELAXED);
+        long num_rooms = __atomic_load_n(&s->rooms, __ATOMIC_RELAXED);
+        long guesses = __atomic_load_n(&s->guesses, __ATOMIC_RELAXED);
+        long games = __atomic_load_n(&s->games, __ATOMIC_RELAXED);
+        long shed = __atomic_load_n(&s->shed, __ATOMIC_RELAXED);
+        printf("%-8d %10ld %10ld %10ld %10ld %10ld %10ld\n",
+            workers[i].id, accepted, clients, num_rooms, guesses, games, shed);
+        total.accepted += accepted;
+        total.clients += clients;
+        total.rooms += num_rooms;
+        total.guesses += guesses;
+        total.games += games;
+        total.shed += shed;
+    }
+    printf("%-8s %10ld %10ld %10ld %10ld %10ld %10ld\n", "total",
+        total.accepted, total.clients, total.rooms, total.guesses, total.games,
+        total.shed);
+    fflush(stdout);
+}
+
+
+/* Print the counter at offset in struct worker_stats of every worker, as the
+ * metric name of the given type.
+ */
+void print_worker_stat(FILE *out, const char *name, const char *type,
+        size_t offset, struct worker *workers, int num_workers) {
+    fprintf(out, "# TYPE %s %s\n", name, type);
+    for (int i = 0; i < num_workers; i++) {
+        long *counter = (long *)((char *)&workers[i].stats + offset);
+        fprintf(out, "%s{worker=\"%d\"} %ld\n", name, workers[i].id,
+            __atomic_load_n(counter, __ATOMIC_RELAXED));
+    }
+}
+
+
+/* Print the statistics of each worker, and the metrics of all of them
+ * together, in the Prometheus text format.
+ */
+void print_metrics_text(FILE *out, struct worker *workers, int num_workers) {
+    static struct metrics total;
+    print_worker_stat(out, "hangman_accepted_total", "counter",
+        offsetof(struct worker_stats, accepted), workers, num_workers);
+    print_worker_stat(out, "hangman_clients", "gauge",
+        offsetof(struct worker_stats, clients), workers, num_workers);
+    print_worker_stat(out, "hangman_rooms", "gauge",
+        offsetof(struct worker_stats, rooms), workers, num_workers);
+    print_worker_stat(out, "hangman_guesses_total", "counter",
+        offsetof(struct worker_stats, guesses), workers, num_workers);
+    print_worker_stat(out, "hangman_games_total", "counter",
+        offsetof(struct worker_stats, games), workers, num_workers);
+    print_worker_stat(out, "hangman_shed_total", "counter",
+        offsetof(struct worker_stats, shed), workers, num_workers);
+    fprintf(out, "# TYPE hangman_names gauge\nhangman_names %ld\n", names_in_use());
+
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < num_workers; i++) {
+        sum_metrics(&total, &workers[i].metrics);
+    }
+    print_metrics(out, &total);
+}
+
+
+/* Answer every connection to the admin socket with the current metrics,
+ * then close it. This runs on its own thread, so a slow reader never holds
+ * up a worker.
+ */
+void *run_admin(void *arg) {
+    struct admin *admin = arg;
+    int failures = 0;
+    while (1) {
+        int fd = accept(admin->listenfd, NULL, NULL);
+        if (fd < 0) {
+            accept_backoff("admin", &failures);
+            continue;
+        }
+        failures = 0;
+        FILE *out = fdopen(fd, "w");
+        if (out == NULL) {
+            perror("fdopen");
+            close(fd);
+            continue;
+        }
+        print_metrics_text(out, admin->workers, admin->num_workers);
+        fclose(out);
+    }
+    return NULL;
+}
+
+
+/* Replay the recording at path, with a thread for each worker that was
+ * recorded, report how long it took and exit. Results are only kept in
+ * memory.
+ */
+void replay_recording(const char *path) {
+    if (open_replay(path, &replay) == -1) {
+        exit(1);
+    }
+    replaying = 1;
+    use_io_uring = 0;
+    load_scores(NULL);
+    struct worker *workers = calloc(replay.num_workers, sizeof(struct worker));
+    if (!workers) {
+        perror("calloc");
+        exit(1);
+    }
+    start_logger();
+    start_scores();
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < replay.num_workers; i++) {
+        workers[i].id = i;
+        if (pthread_create(&workers[i].thread, NULL, run_replay, &workers[i]) != 0) {
+            fprintf(stderr, "Could not start worker %d\n", i);
+            exit(1);
+        }
+    }
+    long guesses = 0, games = 0;
+    for (int i = 0; i < replay.num_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        guesses += workers[i].stats.guesses;
+        games += workers[i].stats.games;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    log_info("Replayed %s (%zu KB) in %.3f s: %ld guesses (%.0f/s) in %ld games",
+        path, replay.len / 1024, elapsed, guesses, elapsed > 0 ? guesses / elapsed : 0, games);
+    exit(0);
+}
+
+
+int main(int argc, char **argv) {
+    int num_threads = 1;
+    char *admin_path = NULL;
+    char *stats_path = NULL;
+    char *upgrade_path = NULL;
+    char *record_path = NULL;
+    char *replay_path = NULL;
+    int level = BAND_ANY;
+    struct option long_options[] = {
+        {"threads", required_argument, NULL, 't'},
+        {"max-backlog", required_argument, NULL, 'b'},
+        {"max-stall", required_argument, NULL, 's'},
+        {"turn-timeout", required_argument, NULL, 'T'},
+        {"name-timeout", required_argument, NULL, 'N'},
+        {"idle-timeout", required_argument, NULL, 'I'},
+        {"admin", required_argument, NULL, 'a'},
+        {"io-uring", no_argument, NULL, 'u'},
+        {"listen-backlog", required_argument, NULL, 'L'},
+        {"stats-log", required_argument, NULL, 'l'},
+        {"upgrade", required_argument, NULL, 'U'},
+        {"level", required_argument, NULL, 'D'},
+        {"record", required_argument, NULL, 'R'},
+        {"replay", required_argument, NULL, 'P'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "t:b:s:T:N:I:a:uL:l:U:D:R:P:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            num_threads = strtol(optarg, NULL, 10);
+            break;
+        case 'b':
+            max_backlog = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            max_stall = strtol(optarg, NULL, 10);
+            break;
+        case 'T':
+            turn_timeout = strtol(optarg, NULL, 10);
+            break;
+        case 'N':
+            name_timeout = strtol(optarg, NULL, 10);
+            break;
+        case 'I':
+            idle_timeout = strtol(optarg, NULL, 10);
+            break;
+        case 'a':
+            admin_path = optarg;
+            break;
+        case 'u':
+            use_io_uring = 1;
+            break;
+        case 'L':
+            listen_backlog = strtol(optarg, NULL, 10);
+            break;
+        case 'l':
+            stats_path = optarg;
+            break;
+        case 'U':
+            upgrade_path = optarg;
+            break;
+        case 'D':
+            level = parse_band(optarg);
+            break;
+        case 'R':
+            record_path = optarg;
+            break;
+        case 'P':
+            replay_path = optarg;
+            break;
+        default:
+            num_threads = -1;
+        }
+    }
+    if(optind != argc - 1 || num_threads < 1 || num_threads > MAX_THREADS
+        || max_backlog < 1 || max_stall < 0
+        || turn_timeout < 0 || name_timeout < 0 || idle_timeout < 0
+        || listen_backlog < 1 || level == -1 || (record_path && replay_path)){
+        fprintf(stderr,"Usage: %s [--threads N] [--max-backlog BYTES] "
+            "[--max-stall SECONDS] [--turn-timeout SECONDS] "
+            "[--name-timeout SECONDS] [--idle-timeout SECONDS] "
+            "[--admin SOCKET_PATH] [--io-uring] [--listen-backlog N] "
+            "[--stats-log FILE] [--upgrade SOCKET_PATH] [--level easy|medium|hard|any] "
+            "[--record FILE | --replay FILE] <dictionary filename>\n", argv[0]);
+        exit(1);
+    }
+    default_band = level;
+
     // Ignore SIGPIPE
     struct sigaction sa;
     sa.sa_handler = SIG_IGN;
@@ -204,153 +1686,144 @@ int main(int argc, char **argv) {
         perror("sigaction");
         exit(1);
     }
-    
-    // Create and initialize the game state
-    struct game_state game;
+
+    // SIGUSR2 interrupts a worker's wait for events when it has to park
+    // for a live upgrade
+    sa.sa_handler = wake_up;
+    if(sigaction(SIGUSR2, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(1);
+    }
+
+    // SIGUSR1 and SIGHUP are only handled by the main thread, which prints
+    // statistics and reloads the dictionary respectively. Block them before
+    // creating the workers so that they inherit the mask.
+    sigset_t main_signals;
+    sigemptyset(&main_signals);
+    sigaddset(&main_signals, SIGUSR1);
+    sigaddset(&main_signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &main_signals, NULL);
 
     srandom((unsigned int)time(NULL));
-    // Set up the file pointer outside of init_game because we want to 
-    // just rewind the file when we need to pick a new word
-    game.dict.fp = NULL;
-    game.dict.size = get_file_length(argv[1]);
-
-    init_game(&game, argv[1]);
-    
-    // head and has_next_turn also don't change when a subsequent game is
-    // started so we initialize them here.
-    game.head = NULL;
-    game.has_next_turn = NULL;
-    
-    /* A list of client who have not yet entered their name.  This list is
-     * kept separate from the list of active players in the game, because
-     * until the new playrs have entered a name, they should not have a turn
-     * or receive broadcast messages.  In other words, they can't play until
-     * they have a name.
-     */
-    struct client *new_players = NULL;
-    
+
+    // Load the dictionary; it is shared read-only by every worker
+    char *dict_name = argv[optind];
+    struct dictionary *dict = load_dictionary(dict_name);
+    if (dict == NULL) {
+        exit(1);
+    }
+    publish_dictionary(dict);
+
+    // Go through a recording again instead of serving, as fast as possible
+    if (replay_path != NULL) {
+        replay_recording(replay_path);
+    }
+    load_scores(stats_path);
+
+    // Open one listener per worker. With more than one, they share the port
+    // through SO_REUSEPORT and the kernel spreads connections across them.
+    struct worker *workers = calloc(num_threads, sizeof(struct worker));
+    if (!workers) {
+        perror("calloc");
+        exit(1);
+    }
     struct sockaddr_in *server = init_server(PORT);
-    int listenfd = set_up_socket(server, MAX_QUEUE);
-    
-    // initialize allset and add listenfd to the
-    // set of file descriptors passed into select
-    FD_ZERO(&allset);
-    FD_SET(listenfd, &allset);
-    // maxfd identifies how far into the set to search
-    maxfd = listenfd;
+    for (int i = 0; i < num_threads; i++) {
+        workers[i].id = i;
+        workers[i].seed = random();
+    }
 
-    while (1) {
-        // make a copy of the set before we pass it into select
-        rset = allset;
-        nready = select(maxfd + 1, &rset, NULL, NULL, NULL);
-        if (nready == -1) {
-            perror("select");
-            continue;
+    // Take over the sockets and games of the server being upgraded, if it
+    // is running. It stops serving from here until the workers start. This
+    // is done before any other thread exists, since growing the descriptor
+    // table of a process with threads waits for an RCU grace period.
+    if (upgrade_path != NULL && take_over(upgrade_path, workers, num_threads, server)) {
+        scores_catch_up();
+    } else {
+        for (int i = 0; i < num_threads; i++) {
+            workers[i].listenfd = set_up_socket(server, listen_backlog, num_threads > 1);
         }
+    }
 
-        if (FD_ISSET(listenfd, &rset)){
-            printf("A new client is connecting\n");
-            clientfd = accept_connection(listenfd);
+    // Record what reaches the workers, to replay it later
+    if (record_path != NULL) {
+        start_recording(record_path, num_threads);
+    }
 
-            FD_SET(clientfd, &allset);
-            if (clientfd > maxfd) {
-                maxfd = clientfd;
-            }
-            printf("Connection from %s\n", inet_ntoa(q.sin_addr));
-            add_player(&new_players, clientfd, q.sin_addr);
-            char *greeting = WELCOME_MSG;
-            if(write(clientfd, greeting, strlen(greeting)) == -1) {
-                fprintf(stderr, "Write to client %s failed\n", inet_ntoa(q.sin_addr));
-                remove_player(&new_players, p->fd);
-            };
-        }
-        
-        /* Check which other socket descriptors have something ready to read.
-         * The reason we iterate over the rset descriptors at the top level and
-         * search through the two lists of clients each time is that it is
-         * possible that a client will be removed in the middle of one of the
-         * operations. This is also why we call break after handling the input.
-         * If a client has been removed the loop variables may not longer be 
-         * valid.
-         */
-        int cur_fd;
-        for(cur_fd = 0; cur_fd <= maxfd; cur_fd++) {
-            if(FD_ISSET(cur_fd, &rset)) {
-                
-                // Check if this socket descriptor is an active player 
-                for(p = game.head; p != NULL; p = p->next) {
-                    if(cur_fd == p->fd) {
-
-                        // Handle input from client with current turn                  
-                        if (p == game.has_next_turn){
-                            int guess_status = process_turn_input(&game, p);
-                            
-                            // If guess is valid (single, lowercase, unguessed letter)
-                            if (guess_status == 0){
-                                if (check_game_over(&game, p) == 0){
-                                    start_new_game(&game, argv[1]);
-                                }
-                                announce_status(&game, NULL);
-                                announce_turn(&game);
-
-                            // If reading has found a network newline
-                            } else if (guess_status > -1){ 
-                                null_terminate_all(p->in_ptr, MAX_BUF);
-                            }
-                         // Handle input from client who doesnt have their turn
-                         } else {
-                            if (game_read(&game, p, p->in_ptr, MAX_BUF) == 0){
-                                char *ignore_msg = "It's not yet your turn!\r\n";
-                                printf("Player %s tried to guess out of turn\n", p->name);
-                                null_terminate_all(p->in_ptr, MAX_BUF);
-                                game_write(&game, p, ignore_msg, strlen(ignore_msg));
-                            }
-                        }
-                        FD_CLR(cur_fd, &rset);
-                        break;
-                    }
-                }
-        
-                // Check if this socket descriptor is adding their name
-                for(p = new_players; p != NULL; p = p->next) {
-                    if(cur_fd == p->fd) {
-                        int name_len = ask_for_name(&game, p);
-                        char name_msg[MAX_MSG]; 
-                        // if name is valid
-                        if (name_len > 0){
-                            activate_player(&new_players, &game, p);
-
-                            
-                            // if this is the first person to be added
-                            if (game.has_next_turn == NULL){
-                                advance_turn(&game);
-                            }
-
-                            sprintf(name_msg, "%s has entered the game!\r\n", p->name);
-                            broadcast(&game, name_msg);
-                            announce_status(&game, p);
-                            announce_turn(&game);
-
-                        //if name not finished writing, just pass
-                        } else if (name_len == -3){
-
-                        //if name is NOT valid
-                        } else {
-                            if (name_len == 0){
-                                sprintf(name_msg, "Please enter a non-empty name...\r\n");
-                            } else if (name_len == -2){
-                                sprintf(name_msg, "That name is already taken. Try another name\r\n");
-                            } 
-                            if (name_len == -1 || write(cur_fd, name_msg, strlen(name_msg)) == -1){
-                                remove_player(&new_players, cur_fd);
-                            }
-                            null_terminate_all(p->name, MAX_NAME);
-                        }
-                        
-                        FD_CLR(cur_fd, &rset);
-                        break;
-                    }
-                }
+    // Log records are written by a background thread, so that the workers
+    // never wait on standard output. Records logged so far are written once
+    // it starts.
+    start_logger();
+
+    // Game results are saved and counted by another background thread, so
+    // that a turn never waits for the disk
+    start_scores();
+
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            fprintf(stderr, "Could not start worker %d\n", i);
+            exit(1);
+        }
+    }
+    log_info("Serving on port %d with %d worker thread(s) using %s", PORT,
+        num_threads, use_io_uring ? "io_uring" : "epoll");
+
+    // Hand over to the next build that starts with the same --upgrade.
+    // Workers using io_uring cannot park, since the kernel keeps receiving
+    // into their buffers.
+    if (upgrade_path != NULL && use_io_uring) {
+        log_warn("Live upgrade is not available with io_uring");
+    } else if (upgrade_path != NULL) {
+        struct upgrade *upgrade = malloc(sizeof(struct upgrade));
+        pthread_t upgrade_thread;
+        if (!upgrade) {
+            perror("malloc");
+            exit(1);
+        }
+        upgrade->listenfd = set_up_local_socket(upgrade_path, 1);
+        upgrade->workers = workers;
+        upgrade->num_workers = num_threads;
+        if (pthread_create(&upgrade_thread, NULL, run_upgrade, upgrade) != 0) {
+            fprintf(stderr, "Could not start the upgrade thread\n");
+            exit(1);
+        }
+        log_info("Waiting for upgrades on %s", upgrade_path);
+    }
+
+    // Serve metrics to anyone who connects to the admin socket
+    if (admin_path != NULL) {
+        struct admin *admin = malloc(sizeof(struct admin));
+        pthread_t admin_thread;
+        if (!admin) {
+            perror("malloc");
+            exit(1);
+        }
+        admin->listenfd = set_up_local_socket(admin_path, ADMIN_QUEUE);
+        admin->workers = workers;
+        admin->num_workers = num_threads;
+        if (pthread_create(&admin_thread, NULL, run_admin, admin) != 0) {
+            fprintf(stderr, "Could not start the admin thread\n");
+            exit(1);
+        }
+        log_info("Serving metrics on %s", admin_path);
+    }
+
+    // Print statistics whenever SIGUSR1 is received. Reload the dictionary
+    // whenever SIGHUP is received; the workers keep serving meanwhile, and
+    // games in progress keep using the previous version until they finish.
+    while (1) {
+        int sig;
+        if (sigwait(&main_signals, &sig) != 0) {
+            continue;
+        }
+        if (sig == SIGUSR1) {
+            print_stats(workers, num_threads);
+        } else if (sig == SIGHUP) {
+            struct dictionary *new_dict = load_dictionary(dict_name);
+            if (new_dict != NULL) {
+                publish_dictionary(new_dict);
+            } else {
+                log_warn("Keeping the current dictionary");
             }
         }
     }
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "snapshot.h"
+#include "network.h"
+
+/* What is sent ahead of the state itself */
+struct snapshot_header {
+    int magic;
+    int version;
+    int num_fds;
+    size_t len;
+};
+
+
+/* Initialize an empty snapshot */
+void init_snapshot(struct snapshot *s){
+    memset(s, 0, sizeof(*s));
+}
+
+
+/* Free the memory used by s and empty it. The descriptors are left open. */
+void free_snapshot(struct snapshot *s){
+    free(s->data);
+    free(s->fds);
+    init_snapshot(s);
+}
+
+
+/* Append len bytes at buf to the state in s */
+void snapshot_put(struct snapshot *s, const void *buf, size_t len){
+    if (s->len + len > s->cap){
+        size_t cap = s->cap > 0 ? s->cap : 4096;
+        while (cap < s->len + len){
+            cap *= 2;
+        }
+        s->data = realloc(s->data, cap);
+        if (!s->data){
+            perror("realloc");
+            exit(1);
+        }
+        s->cap = cap;
+    }
+    memcpy(s->data + s->len, buf, len);
+    s->len += len;
+}
+
+
+/* Append value to the state in s */
+void snapshot_put_int(struct snapshot *s, int value){
+    snapshot_put(s, &value, sizeof(value));
+}
+
+
+/* Append the len bytes at buf, which need not be a string, with their length */
+void snapshot_put_str(struct snapshot *s, const char *buf, int len){
+    snapshot_put_int(s, len);
+    snapshot_put(s, buf, len);
+}
+
+
+/* Append a reference to fd, which is passed along with the state */
+void snapshot_put_fd(struct snapshot *s, int fd){
+    if (s->num_fds == s->fd_cap){
+        s->fd_cap = s->fd_cap > 0 ? s->fd_cap * 2 : 256;
+        s->fds = realloc(s->fds, s->fd_cap * sizeof(int));
+        if (!s->fds){
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->fds[s->num_fds] = fd;
+    snapshot_put_int(s, s->num_fds++);
+}
+
+
+/* Return a pointer to the next len bytes of the state, or NULL if there
+ * are not that many left, in which case s is marked as failed.
+ */
+static const char *get(struct snapshot *s, size_t len){
+    if (s->failed || len > s->len - s->pos){
+        s->failed = 1;
+        return NULL;
+    }
+    const char *p = s->data + s->pos;
+    s->pos += len;
+    return p;
+}
+
+
+/* Return the next int of the state, or 0 if s has failed */
+int snapshot_get_int(struct snapshot *s){
+    int value = 0;
+    const char *p = get(s, sizeof(value));
+    if (p != NULL){
+        memcpy(&value, p, sizeof(value));
+    }
+    return value;
+}
+
+
+/* Return the bytes put by snapshot_put_str, which stay in s, and store their
+ * number in len. Return NULL if s has failed.
+ */
+const char *snapshot_get_str(struct snapshot *s, int *len){
+    *len = snapshot_get_int(s);
+    if (*len < 0){
+        s->failed = 1;
+    }
+    const char *p = get(s, s->failed ? 0 : *len);
+    if (p == NULL){
+        *len = 0;
+    }
+    return p;
+}
+
+
+/* Return the descriptor put by snapshot_put_fd, or -1 if s has failed */
+int snapshot_get_fd(struct snapshot *s){
+    int index = snapshot_get_int(s);
+    if (s->failed || index < 0 || index >= s->num_fds){
+        s->failed = 1;
+        return -1;
+    }
+    return s->fds[index];
+}
+
+
+/* Write the count bytes at buf to fd, however many writes it takes.
+ * Return 0 on success and -1 on failure.
+ */
+static int write_all(int fd, const void *buf, size_t count){
+    const char *p = buf;
+    while (count > 0){
+        ssize_t n = write(fd, p, count);
+        if (n < 0 && errno == EINTR){
+            continue;
+        } else if (n <= 0){
+            return -1;
+        }
+        p += n;
+        count -= n;
+    }
+    return 0;
+}
+
+
+/* Read exactly count bytes from fd into buf.
+ * Return 0 on success and -1 on failure or end of file.
+ */
+static int read_all(int fd, void *buf, size_t count){
+    char *p = buf;
+    while (count > 0){
+        ssize_t n = read(fd, p, count);
+        if (n < 0 && errno == EINTR){
+            continue;
+        } else if (n <= 0){
+            return -1;
+        }
+        p += n;
+        count -= n;
+    }
+    return 0;
+}
+
+
+/* Send s, with duplicates of its descriptors, over the Unix socket soc.
+ * Return 0 on success and -1 on failure.
+ */
+int send_snapshot(int soc, const struct snapshot *s){
+    struct snapshot_header header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, s->num_fds, s->len};
+    if (write_all(soc, &header, sizeof(header)) == -1){
+        return -1;
+    }
+    for (int i = 0; i < s->num_fds; i += MAX_FDS_PER_MSG){
+        int count = s->num_fds - i < MAX_FDS_PER_MSG ? s->num_fds - i : MAX_FDS_PER_MSG;
+        if (send_fds(soc, s->fds + i, count) == -1){
+            return -1;
+        }
+    }
+    return write_all(soc, s->data, s->len);
+}
+
+
+/* Close the descriptors received into s so far */
+static void close_fds(struct snapshot *s){
+    for (int i = 0; i < s->num_fds; i++){
+        close(s->fds[i]);
+    }
+    s->num_fds = 0;
+}
+
+
+/* Receive a snapshot sent by send_snapshot over soc into s, which must be
+ * empty. Its descriptors are open in this process once it returns.
+ * Return 0 on success and -1 on failure, in which case none of them are.
+ */
+int recv_snapshot(int soc, struct snapshot *s){
+    struct snapshot_header header;
+    if (read_all(soc, &header, sizeof(header)) == -1){
+        return -1;
+    }
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION
+            || header.num_fds < 0){
+        fprintf(stderr, "The running server sent a snapshot this build cannot read\n");
+        return -1;
+    }
+
+    s->fds = malloc((header.num_fds + 1) * sizeof(int));
+    s->data = malloc(header.len + 1);
+    if (!s->fds || !s->data){
+        perror("malloc");
+        exit(1);
+    }
+    s->fd_cap = header.num_fds + 1;
+    s->cap = header.len + 1;
+    while (s->num_fds < header.num_fds){
+        int count = header.num_fds - s->num_fds;
+        if (count > MAX_FDS_PER_MSG){
+            count = MAX_FDS_PER_MSG;
+        }
+        if (recv_fds(soc, s->fds + s->num_fds, count) == -1){
+            close_fds(s);
+            return -1;
+        }
+        s->num_fds += count;
+    }
+    if (read_all(soc, s->data, header.len) == -1){
+        close_fds(s);
+        return -1;
+    }
+    s->len = header.len;
+    return 0;
+}
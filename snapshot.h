@@ -0,0 +1,38 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stddef.h>
+
+#define SNAPSHOT_MAGIC 0x48414e47   // "HANG"
+#define SNAPSHOT_VERSION 3
+
+/* The state of a running server, written out by one process and read back
+ * by the process that takes over from it. The state is a sequence of ints
+ * and strings in host byte order, since both processes run on the same
+ * machine. File descriptors are stored by their index in fds, and passed
+ * alongside the state, so that they are valid in the receiving process.
+ */
+struct snapshot {
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t pos;               // Where the next get reads from
+    int failed;               // Set once a get ran past the end
+    int *fds;                 // Descriptors referred to by the state
+    int num_fds;
+    int fd_cap;
+};
+
+void init_snapshot(struct snapshot *s);
+void free_snapshot(struct snapshot *s);
+void snapshot_put(struct snapshot *s, const void *buf, size_t len);
+void snapshot_put_int(struct snapshot *s, int value);
+void snapshot_put_str(struct snapshot *s, const char *buf, int len);
+void snapshot_put_fd(struct snapshot *s, int fd);
+int snapshot_get_int(struct snapshot *s);
+const char *snapshot_get_str(struct snapshot *s, int *len);
+int snapshot_get_fd(struct snapshot *s);
+int send_snapshot(int soc, const struct snapshot *s);
+int recv_snapshot(int soc, struct snapshot *s);
+
+#endif
@@ -0,0 +1,172 @@
+#include <string.h>
+#include <time.h>
+
+#include "timer.h"
+
+// The timing wheel of the worker running on the current thread
+static __thread struct timer_wheel wheel;
+static __thread struct timespec started;
+
+
+/* Return the number of milliseconds since init_timers was called */
+static int64_t elapsed_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec - started.tv_sec) * 1000
+        + (ts.tv_nsec - started.tv_nsec) / 1000000;
+}
+
+
+/* Add t to the head of the list *head */
+static void link_timer(struct timer **head, struct timer *t){
+    t->next = *head;
+    if (*head != NULL){
+        (*head)->pprev = &t->next;
+    }
+    *head = t;
+    t->pprev = head;
+}
+
+
+/* Remove t from the list it is in */
+static void unlink_timer(struct timer *t){
+    *t->pprev = t->next;
+    if (t->next != NULL){
+        t->next->pprev = t->pprev;
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+
+/* Put t in the slot of the lowest level that reaches t->expires */
+static void place_timer(struct timer *t){
+    uint64_t delta = t->expires - wheel.now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (uint64_t) 1 << (WHEEL_BITS * (level + 1))){
+        level++;
+    }
+    int slot = (t->expires >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+    link_timer(&wheel.slots[level][slot], t);
+}
+
+
+/* Start the timing wheel of the current thread */
+void init_timers(void){
+    memset(&wheel, 0, sizeof(wheel));
+    clock_gettime(CLOCK_MONOTONIC, &started);
+}
+
+
+/* Initialize t, which is not armed, to call expire when it expires */
+void init_timer(struct timer *t, void (*expire)(struct timer *t)){
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->expire = expire;
+}
+
+
+/* Arm t to expire in ms milliseconds, rearming it if it is already armed.
+ * Delays are rounded up to a whole number of ticks.
+ */
+void arm_timer(struct timer *t, long ms){
+    cancel_timer(t);
+    uint64_t ticks = (ms + TICK_MS - 1) / TICK_MS;
+    uint64_t max_ticks = ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    if (ticks < 1){
+        ticks = 1;
+    } else if (ticks > max_ticks){
+        ticks = max_ticks;
+    }
+    t->expires = wheel.now + ticks;
+    place_timer(t);
+    wheel.count++;
+}
+
+
+/* Disarm t if it is armed */
+void cancel_timer(struct timer *t){
+    if (t->pprev != NULL){
+        unlink_timer(t);
+        wheel.count--;
+    }
+}
+
+
+/* Move the timers of slot on level down to the levels below */
+static void cascade(int level, int slot){
+    struct timer *list = wheel.slots[level][slot];
+    wheel.slots[level][slot] = NULL;
+    while (list != NULL){
+        struct timer *t = list;
+        list = t->next;
+        place_timer(t);
+    }
+}
+
+
+/* Advance the wheel by one tick and call every timer that expires */
+static void tick(void){
+    wheel.now++;
+
+    // When a level wraps around, the next slot of the level above comes up
+    for (int level = 1; level < WHEEL_LEVELS; level++){
+        if ((wheel.now & (((uint64_t) 1 << (WHEEL_BITS * level)) - 1)) != 0){
+            break;
+        }
+        cascade(level, (wheel.now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1));
+    }
+
+    // Take the slot off the wheel first, since expire may arm or cancel
+    // timers, including the ones that are left in it
+    int slot = wheel.now & (WHEEL_SIZE - 1);
+    struct timer *list = wheel.slots[0][slot];
+    wheel.slots[0][slot] = NULL;
+    if (list != NULL){
+        list->pprev = &list;
+    }
+    while (list != NULL){
+        struct timer *t = list;
+        unlink_timer(t);
+        wheel.count--;
+        t->expire(t);
+    }
+}
+
+
+/* Call every timer that has expired since the last call */
+void run_timers(void){
+    uint64_t target = elapsed_ms() / TICK_MS;
+
+    // With nothing armed there is nothing to move or call
+    if (wheel.count == 0){
+        wheel.now = target;
+        return;
+    }
+    while (wheel.now < target){
+        tick();
+    }
+}
+
+
+/* Return the number of milliseconds until the next tick that has a timer to
+ * call or to move down a level, or -1 if no timer is armed, which is how
+ * long the event loop may wait for events.
+ */
+int timer_timeout(void){
+    if (wheel.count == 0){
+        return -1;
+    }
+    // Level 0 holds the timers of the next WHEEL_SIZE - 1 ticks; the levels
+    // above only move theirs down when level 0 wraps around
+    uint64_t next = (wheel.now | (WHEEL_SIZE - 1)) + 1;
+    for (uint64_t t = wheel.now + 1; t < next; t++){
+        if (wheel.slots[0][t & (WHEEL_SIZE - 1)] != NULL){
+            next = t;
+            break;
+        }
+    }
+    int64_t ms = (int64_t) next * TICK_MS - elapsed_ms();
+    return ms > 0 ? ms : 0;
+}
@@ -0,0 +1,45 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TICK_MS 100           // Resolution of the timers
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4        // Timers can be armed up to about 19 days ahead
+
+// Return the struct of the given type that member ptr is embedded in
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+/* A timer embedded in the struct it belongs to. When it expires, expire is
+ * called with it and the timer is no longer armed.
+ */
+struct timer {
+    struct timer *next;
+    struct timer **pprev;     // The pointer to this timer, or NULL if not armed
+    uint64_t expires;         // Tick at which the timer expires
+    void (*expire)(struct timer *t);
+};
+
+/* The timers of one worker thread, kept in a hierarchical timing wheel so
+ * that arming and cancelling a timer take constant time. Level 0 has a slot
+ * for each of the next WHEEL_SIZE ticks; each level above has slots that
+ * are WHEEL_SIZE times as long, and its timers are moved down a level when
+ * their slot comes up.
+ */
+struct timer_wheel {
+    uint64_t now;             // Ticks since the wheel was started
+    long count;               // Number of armed timers
+    struct timer *slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+void init_timers(void);
+void init_timer(struct timer *t, void (*expire)(struct timer *t));
+void arm_timer(struct timer *t, long ms);
+void cancel_timer(struct timer *t);
+void run_timers(void);
+int timer_timeout(void);
+
+#endif
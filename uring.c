@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+#include "metrics.h"
+
+#ifndef USE_IO_URING
+    #define USE_IO_URING 0
+#endif
+
+int use_io_uring = USE_IO_URING;
+
+/* The io_uring instance of one worker thread, with the rings it shares
+ * with the kernel. Received data goes to buffers the kernel picks from a
+ * ring of provided buffers, which are handed back once they are handled.
+ */
+struct uring {
+    int fd;
+
+    // Submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_queued;       // Entries filled in, including unsubmitted ones
+    struct io_uring_sqe *sqes;
+
+    // Completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Provided receive buffers
+    struct io_uring_buf_ring *bufs;
+    char *buf_mem;
+    unsigned short buf_tail;
+};
+
+static __thread struct uring ring;
+
+
+/* Call io_uring_enter for the ring of the current thread */
+static int enter(unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size){
+    metrics_add(CTR_SYSCALLS, 1);
+    return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+
+/* Return the number of entries filled in but not yet seen by the kernel */
+static unsigned unsubmitted(void){
+    return ring.sq_queued - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+}
+
+
+/* Return a cleared submission queue entry. It is submitted by the next
+ * call to uring_wait, or right away if the queue is full.
+ */
+static struct io_uring_sqe *get_sqe(void){
+    if (unsubmitted() == ring.sq_entries){
+        enter(ring.sq_entries, 0, 0, NULL, 0);
+    }
+    unsigned index = ring.sq_queued & ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[index] = index;
+    return sqe;
+}
+
+
+/* Make the entry returned by the last get_sqe visible to the kernel */
+static void commit_sqe(void){
+    ring.sq_queued++;
+    __atomic_store_n(ring.sq_tail, ring.sq_queued, __ATOMIC_RELEASE);
+}
+
+
+/* Give receive buffer bid back to the kernel */
+static void add_buffer(int bid){
+    struct io_uring_buf *b = &ring.bufs->bufs[ring.buf_tail & (RECV_BUFS - 1)];
+    b->addr = (uint64_t)(uintptr_t)(ring.buf_mem + bid * RECV_BUF_SIZE);
+    b->len = RECV_BUF_SIZE;
+    b->bid = bid;
+    ring.buf_tail++;
+}
+
+
+/* Map the rings of the instance described by p */
+static int map_rings(struct io_uring_params *p){
+    size_t sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    size_t cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP){
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring.fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED){
+        perror("mmap");
+        return -1;
+    }
+    char *cq = sq;
+    if (!(p->features & IORING_FEAT_SINGLE_MMAP)){
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring.fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED){
+            perror("mmap");
+            return -1;
+        }
+    }
+    ring.sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED){
+        perror("mmap");
+        return -1;
+    }
+
+    ring.sq_head = (unsigned *)(sq + p->sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p->sq_off.tail);
+    ring.sq_array = (unsigned *)(sq + p->sq_off.array);
+    ring.sq_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+    ring.sq_entries = p->sq_entries;
+    ring.sq_queued = *ring.sq_tail;
+    ring.cq_head = (unsigned *)(cq + p->cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p->cq_off.tail);
+    ring.cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    return 0;
+}
+
+
+/* Register RECV_BUFS receive buffers of RECV_BUF_SIZE bytes as group
+ * RECV_GROUP.
+ */
+static int register_buffers(void){
+    ring.bufs = mmap(NULL, RECV_BUFS * sizeof(struct io_uring_buf),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring.buf_mem = malloc(RECV_BUFS * RECV_BUF_SIZE);
+    if (ring.bufs == MAP_FAILED || !ring.buf_mem){
+        perror("buffers");
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t) ring.bufs;
+    reg.ring_entries = RECV_BUFS;
+    reg.bgid = RECV_GROUP;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+        perror("io_uring_register");
+        return -1;
+    }
+    ring.buf_tail = 0;
+    for (int i = 0; i < RECV_BUFS; i++){
+        add_buffer(i);
+    }
+    __atomic_store_n(&ring.bufs->tail, ring.buf_tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+/* Create the io_uring instance of the current thread.
+ * Return 0 on success and -1 if io_uring is not available.
+ */
+int uring_init(void){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL
+        | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = URING_CQ_ENTRIES;
+    ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (ring.fd < 0){
+        perror("io_uring_setup (kernel 6.1 or later is needed)");
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG)){
+        fprintf(stderr, "io_uring does not support timeouts on wait\n");
+        return -1;
+    }
+    if (map_rings(&p) == -1 || register_buffers() == -1){
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Accept every connection to the listening socket fd until cancelled */
+void uring_accept(int fd){
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = URING_DATA(NULL, OP_ACCEPT);
+    commit_sqe();
+}
+
+
+/* Receive everything sent to fd into the provided buffers, until the
+ * connection is closed or the buffers run out.
+ */
+void uring_recv(int fd, void *ptr){
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_GROUP;
+    sqe->user_data = URING_DATA(ptr, OP_RECV);
+    commit_sqe();
+}
+
+
+/* Send len bytes at buf to fd. buf must stay valid until the send
+ * completes.
+ */
+void uring_send(int fd, const char *buf, int len, void *ptr){
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t) buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = URING_DATA(ptr, OP_SEND);
+    commit_sqe();
+}
+
+
+/* Submit every queued entry and wait up to timeout milliseconds (forever
+ * if timeout is -1) for a completion, with a single system call.
+ * Return 0, or -1 if waiting failed.
+ */
+int uring_wait(int timeout){
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    unsigned min_complete = uring_peek() == NULL ? 1 : 0;
+    void *argp = NULL;
+    size_t arg_size = 0;
+
+    if (timeout >= 0){
+        memset(&arg, 0, sizeof(arg));
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        arg.ts = (uint64_t)(uintptr_t) &ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        arg_size = sizeof(arg);
+    }
+    if (enter(unsubmitted(), min_complete, flags, argp, arg_size) < 0
+            && errno != ETIME && errno != EINTR){
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Return the oldest completion that has not been handled, or NULL */
+struct io_uring_cqe *uring_peek(void){
+    unsigned head = *ring.cq_head;
+    if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)){
+        return NULL;
+    }
+    return &ring.cqes[head & ring.cq_mask];
+}
+
+
+/* Mark the completion returned by uring_peek as handled */
+void uring_advance(void){
+    __atomic_store_n(ring.cq_head, *ring.cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Return the receive buffer that the data of cqe was put in */
+char *uring_buffer(const struct io_uring_cqe *cqe){
+    return ring.buf_mem + (cqe->flags >> IORING_CQE_BUFFER_SHIFT) * RECV_BUF_SIZE;
+}
+
+
+/* Hand the receive buffer of cqe, if any, back to the kernel */
+void uring_recycle(const struct io_uring_cqe *cqe){
+    if (cqe->flags & IORING_CQE_F_BUFFER){
+        add_buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        __atomic_store_n(&ring.bufs->tail, ring.buf_tail, __ATOMIC_RELEASE);
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 4096
+#define URING_CQ_ENTRIES 16384
+#define RECV_BUFS 1024        // Receive buffers per worker; a power of two
+#define RECV_BUF_SIZE 512
+#define RECV_GROUP 0
+
+/* The operation a completion belongs to is kept in the low bits of its
+ * user_data, next to the pointer it was submitted with.
+ */
+enum uring_op {
+    OP_ACCEPT = 1,
+    OP_RECV,
+    OP_SEND
+};
+
+#define URING_DATA(ptr, op) ((uint64_t)(uintptr_t)(ptr) | (op))
+#define URING_PTR(data) ((void *)(uintptr_t)((data) & ~(uint64_t) 7))
+#define URING_OP(data) ((int)((data) & 7))
+
+// Non-zero when the workers use io_uring instead of epoll
+extern int use_io_uring;
+
+int uring_init(void);
+void uring_accept(int fd);
+void uring_recv(int fd, void *ptr);
+void uring_send(int fd, const char *buf, int len, void *ptr);
+int uring_wait(int timeout);
+struct io_uring_cqe *uring_peek(void);
+void uring_advance(void);
+char *uring_buffer(const struct io_uring_cqe *cqe);
+void uring_recycle(const struct io_uring_cqe *cqe);
+
+#endif